@@ -3,6 +3,7 @@
 // SPDX-FileCopyrightText: 2017 Jan-Philipp Litza <janphilipp@litza.de>
 
 
+#include "hexutil.h"
 #include "manifest.h"
 #include "settings.h"
 #include "uclient.h"
@@ -14,45 +15,262 @@
 #include <ecdsautil/ecdsa.h>
 #include <ecdsautil/sha256.h>
 
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <glob.h>
+#include <inttypes.h>
 #include <math.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/types.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/wait.h>
 
 
-#define MAX_LINE_LENGTH 512
-#define STRINGIFY(str) #str
+/* Maximum size of a manifest */
+#define MAX_MANIFEST_SIZE (4*1024*1024)
+/* Number of downloaded bytes after which the download state is saved */
+#define IMAGE_STATE_INTERVAL (256*1024)
+/* Size of the parts of a segmented image download */
+#define SEGMENT_SIZE (1024*1024)
+/* Maximum number of mirrors used for a segmented image download */
+#define MAX_SEGMENT_MIRRORS 4
+/* Inactivity timeout of image downloads from other nodes (in ms) */
+#define PEER_TIMEOUT 10000
 
 static const char *const download_d_dir = "/usr/lib/autoupdater/download.d";
 static const char *const abort_d_dir = "/usr/lib/autoupdater/abort.d";
 static const char *const upgrade_d_dir = "/usr/lib/autoupdater/upgrade.d";
 static const char *const lockfile = "/var/lock/autoupdater.lock";
-static const char *const firmware_path = "/tmp/firmware.bin";
+static const char *const tmp_firmware_path = "/tmp/firmware.bin";
 static const char *const sysupgrade_path = "/sbin/sysupgrade";
+static const char *const bspatch_path = "/usr/bin/bspatch";
+
+/* Paths of the downloaded image and its download state; in the staging directory if one is configured */
+static const char *firmware_path = "/tmp/firmware.bin";
+static const char *firmware_state_path = "/tmp/firmware.state";
+/* Checksum of a staged image that has been downloaded and tested completely (only used with a staging directory) */
+static const char *firmware_verified_path = NULL;
+
+static const char *const manifest_cache_dir = "/var/cache/autoupdater";
+static const char *const report_path = "/var/run/autoupdater.json";
 
 
 struct recv_manifest_ctx {
 	struct settings *s;
 	struct manifest m;
-	char buf[MAX_LINE_LENGTH + 1];
-	char *ptr;
+	const struct manifest_parser *parser;
+	/* The received manifest; it is parsed line by line while it is received, and kept for the cache */
+	char *data;
+	size_t data_len;
+	size_t data_size;
+	/* Length of the complete lines that have been parsed */
+	size_t parsed;
+	/* The manifest has exceeded MAX_MANIFEST_SIZE, the rest has been discarded */
+	bool too_large;
+};
+
+struct recv_delta_ctx {
+	int fd;
+	ecdsa_sha256_context_t hash_ctx;
+	bool failed;
 };
 
 struct recv_image_ctx {
 	int fd;
 	ecdsa_sha256_context_t hash_ctx;
 	ssize_t downloaded;
+	const struct manifest *m;
+	/* Number of bytes written to the file and hashed */
+	ssize_t offset;
+	/* Offset of the last saved download state */
+	ssize_t state_offset;
+	/*
+		Received data that hasn't been written and hashed yet; it is collected
+		in buf, or directly in the mapped firmware file if map is set
+	*/
+	char *buf;
+	size_t buf_size;
+	size_t buf_len;
+	char *map;
+	/* The firmware file is on persistent storage and must not be kept in the page cache */
+	bool staging;
+	/* Writing to the firmware file has failed, the received data is discarded */
+	bool failed;
+};
+
+/**
+	Saved state of an incomplete image download
+
+	The hash context covers the first offset bytes of the firmware file, so
+	the download can be resumed by another mirror, or by the next run if the
+	image is kept in a staging directory.
+*/
+struct image_state {
+	unsigned char image_hash[ECDSA_SHA256_HASH_SIZE];
+	int64_t imagesize;
+	int64_t offset;
+	ecdsa_sha256_context_t hash_ctx;
+};
+
+/** A part of a segmented image download */
+struct segment {
+	ssize_t start;
+	ssize_t end;
+	/* Position the next received byte is written to */
+	ssize_t pos;
+	bool active;
+	bool done;
+};
+
+/** Concurrent requests for the segments of the image to multiple mirrors */
+struct segmented_download {
+	struct recv_image_ctx *image;
+	struct settings *s;
+	size_t n_segments;
+	struct segment *segments;
+	size_t n_active;
+	/* Number of bytes written to the file by all segments */
+	ssize_t written;
+	size_t n_mirrors;
+	struct segment_mirror *mirrors;
+};
+
+/** The connection to a mirror during a segmented download */
+struct segment_mirror {
+	struct segmented_download *dl;
+	const char *mirror;
+	struct uclient *cl;
+	struct segment *segment;
+	/* Used to start the next request outside of the callbacks of the last one */
+	struct uloop_timeout next;
+	bool failed;
 };
 
+/** The validators a mirror has sent with the cached manifest */
+struct manifest_cache_entry {
+	char *url;
+	struct uclient_validators validators;
+};
+
+/**
+	The last manifest that has passed all checks
+
+	Its signatures aren't verified again when a mirror reports that the
+	manifest hasn't changed.
+*/
+struct manifest_cache {
+	char *data;
+	size_t len;
+	size_t n_entries;
+	struct manifest_cache_entry *entries;
+};
+
+/** Concurrent manifest requests to all mirrors */
+struct manifest_fetch {
+	struct settings *s;
+	struct manifest_parser parser;
+	size_t n_pending;
+	struct manifest_request *winner;
+	struct manifest_cache cache;
+};
+
+/** The manifest request to a single mirror */
+struct manifest_request {
+	struct recv_manifest_ctx ctx;
+	struct manifest_fetch *fetch;
+	const char *mirror;
+	char *url;
+	struct uclient *cl;
+	/* The per-model manifest is requested */
+	bool sharded;
+	/* Used to request the full manifest outside of the callbacks of the per-model request */
+	struct uloop_timeout fallback;
+	/* The mirror has confirmed that the cached manifest is still current */
+	bool cached;
+};
+
+
+/** Duration of a single hook script */
+struct report_hook {
+	char *path;
+	int64_t duration;
+	bool timed_out;
+};
+
+/**
+	Timings and outcome of the current run, written to report_path for export (e.g. by respondd)
+
+	Durations are in microseconds; phases that haven't run are -1.
+*/
+static struct run_report {
+	time_t time;
+	const char *result;
+	char *version;
+	int64_t manifest;
+	int64_t verify;
+	int64_t download;
+	int64_t download_bytes;
+	int64_t hash;
+	int64_t test;
+	int64_t download_hooks;
+	int64_t upgrade_hooks;
+	int64_t abort_hooks;
+	size_t n_hooks;
+	struct report_hook *hooks;
+} report;
+
+
+/** Adds the time since start to the duration of a phase */
+static void report_add(int64_t *duration, int64_t start) {
+	if (*duration < 0)
+		*duration = 0;
+
+	*duration += get_monotonic_time_us() - start;
+}
+
+
+/** Hashes image data, accounting the time for the run report */
+static void image_hash_update(ecdsa_sha256_context_t *hash_ctx, const void *data, size_t len) {
+	int64_t start = get_monotonic_time_us();
+	ecdsa_sha256_update(hash_ctx, data, len);
+	report_add(&report.hash, start);
+}
+
+
+static void report_hook_done(const char *path, int64_t duration, bool timed_out, void *arg) {
+	report.n_hooks++;
+	report.hooks = safe_realloc(report.hooks, report.n_hooks * sizeof(*report.hooks));
+	report.hooks[report.n_hooks - 1] = (struct report_hook){
+		.path = strdup(path),
+		.duration = duration,
+		.timed_out = timed_out,
+	};
+}
+
+
+static void run_hooks(const struct settings *s, const char *dir, int64_t *duration) {
+	const struct hook_options opts = {
+		.parallel = s->parallel_hooks,
+		.timeout = s->hook_timeout,
+		.done_cb = report_hook_done,
+	};
+
+	int64_t start = get_monotonic_time_us();
+	run_dir(dir, &opts);
+	report_add(duration, start);
+}
+
 
 static void usage(void) {
 	fputs("\n"
@@ -68,6 +286,11 @@ static void usage(void) {
 		"  --fallback           Upgrade if and only if the upgrade timespan of the new\n"
 		"                       version has passed for at least 24 hours.\n\n"
 		"  --force-version      Skip version check to allow downgrades.\n\n"
+		"  --segmented          Download the image in segments from multiple mirrors\n"
+		"                       in parallel.\n\n"
+		"  --download-only      Download and test a new firmware regardless of its\n"
+		"                       priority, but keep it in the staging directory to be\n"
+		"                       flashed by a later run instead of flashing it.\n\n"
 		"  <mirror> ...         Override the mirror URLs given in the configuration. If\n"
 		"                       specified, these are not shuffled.\n\n",
 		stderr
@@ -83,6 +306,8 @@ static void parse_args(int argc, char *argv[], struct settings *settings) {
 		OPTION_NO_ACTION = 'n',
 		OPTION_FALLBACK = 256,
 		OPTION_FORCE_VERSION = 257,
+		OPTION_SEGMENTED = 258,
+		OPTION_DOWNLOAD_ONLY = 259,
 	};
 
 	const struct option options[] = {
@@ -91,6 +316,8 @@ static void parse_args(int argc, char *argv[], struct settings *settings) {
 		{"fallback",  no_argument,       NULL, OPTION_FALLBACK},
 		{"no-action", no_argument,       NULL, OPTION_NO_ACTION},
 		{"force-version", no_argument, NULL, OPTION_FORCE_VERSION},
+		{"segmented", no_argument,       NULL, OPTION_SEGMENTED},
+		{"download-only", no_argument,   NULL, OPTION_DOWNLOAD_ONLY},
 		{"help",      no_argument,       NULL, OPTION_HELP},
 		{}
 	};
@@ -125,6 +352,14 @@ static void parse_args(int argc, char *argv[], struct settings *settings) {
 			settings->force_version = true;
 			break;
 
+		case OPTION_SEGMENTED:
+			settings->segmented = true;
+			break;
+
+		case OPTION_DOWNLOAD_ONLY:
+			settings->download_only = true;
+			break;
+
 		default:
 			usage();
 			exit(1);
@@ -187,39 +422,34 @@ static float get_probability(time_t date, float priority, bool fallback) {
 }
 
 
-/** Receives data from uclient, chops it to lines and hands it to \ref parse_line */
+/** Receives the manifest from uclient, parsing each line as soon as it is complete */
 static void recv_manifest_cb(struct uclient *cl) {
 	struct recv_manifest_ctx *ctx = uclient_get_custom(cl);
-	char *newline;
 	int len;
 
 	while (true) {
-		if (ctx->ptr - ctx->buf == MAX_LINE_LENGTH) {
-			fputs("autoupdater: error: encountered manifest line exceeding limit of " STRINGIFY(MAX_LINE_LENGTH) " characters\n", stderr);
-			break;
-		}
-		len = uclient_read_account(cl, ctx->ptr, MAX_LINE_LENGTH - (ctx->ptr - ctx->buf));
-		if (len <= 0)
-			break;
-		ctx->ptr[len] = '\0';
-
-		char *line = ctx->buf;
-		while (true) {
-			newline = strchr(line, '\n');
-			if (newline == NULL)
+		if (ctx->data_len == MAX_MANIFEST_SIZE) {
+			/* Discard the rest, so the request can finish */
+			char buf[1024];
+			ctx->too_large = true;
+			if (uclient_read_account(cl, buf, sizeof(buf)) <= 0)
 				break;
-			*newline = '\0';
+			continue;
+		}
 
-			parse_line(line, &ctx->m, ctx->s->branch, platforminfo_get_image_name());
-			line = newline + 1;
+		if (ctx->data_len == ctx->data_size) {
+			ctx->data_size = ctx->data_size ? 2*ctx->data_size : 4096;
+			if (ctx->data_size > MAX_MANIFEST_SIZE)
+				ctx->data_size = MAX_MANIFEST_SIZE;
+			ctx->data = safe_realloc(ctx->data, ctx->data_size);
 		}
 
-		// Move the beginning of the next line to the beginning of the
-		// buffer. We cannot use strcpy here because the memory areas
-		// might overlap!
-		int n = strlen(line);
-		memmove(ctx->buf, line, n);
-		ctx->ptr = ctx->buf + n;
+		len = uclient_read_account(cl, ctx->data + ctx->data_len, ctx->data_size - ctx->data_len);
+		if (len <= 0)
+			break;
+
+		ctx->data_len += len;
+		ctx->parsed += parse_manifest(ctx->parser, &ctx->m, ctx->data + ctx->parsed, ctx->data_len - ctx->parsed);
 	}
 }
 
@@ -250,261 +480,1955 @@ static void update_progress(struct recv_image_ctx *ctx, ssize_t downloaded, ssiz
 }
 
 
-/** Receives data from uclient and writes it to file */
-static void recv_image_cb(struct uclient *cl) {
-	struct recv_image_ctx *ctx = uclient_get_custom(cl);
-	char buf[1024];
-	int len;
+/** Discards the downloaded part of the image */
+static void image_reset(struct recv_image_ctx *ctx) {
+	if (ftruncate(ctx->fd, 0) || lseek(ctx->fd, 0, SEEK_SET)) {
+		fputs("autoupdater: error: failed to truncate firmware file: ", stderr);
+		perror(NULL);
+	}
 
-	while (true) {
-		len = uclient_read_account(cl, buf, sizeof(buf));
-		if (len <= 0)
-			return;
+	unlink(firmware_state_path);
 
-		update_progress(ctx, uclient_data(cl)->downloaded, uclient_data(cl)->length);
+	/* A mapped file must keep its size, the mapping would become invalid otherwise */
+	if (ctx->map && ftruncate(ctx->fd, ctx->m->imagesize)) {
+		fputs("autoupdater: error: failed to resize firmware file: ", stderr);
+		perror(NULL);
+		ctx->failed = true;
+	}
+
+	ecdsa_sha256_init(&ctx->hash_ctx);
+	ctx->offset = 0;
+	ctx->state_offset = 0;
+	ctx->buf_len = 0;
+}
+
+
+/** Writes and hashes the received data collected in the buffer */
+static void image_flush(struct recv_image_ctx *ctx) {
+	const char *data = ctx->map ? ctx->map + ctx->offset : ctx->buf;
+	size_t len = ctx->buf_len;
+
+	ctx->buf_len = 0;
+
+	if (ctx->map) {
+		image_hash_update(&ctx->hash_ctx, data, len);
+		ctx->offset += len;
+		return;
+	}
 
-		if (write(ctx->fd, buf, len) < len) {
+	while (len) {
+		ssize_t w = write(ctx->fd, data, len);
+		if (w < 0) {
 			fputs("autoupdater: error: downloading firmware image failed: ", stderr);
 			perror(NULL);
+			ctx->failed = true;
 			return;
 		}
-		ecdsa_sha256_update(&ctx->hash_ctx, buf, len);
+
+		image_hash_update(&ctx->hash_ctx, data, w);
+		ctx->offset += w;
+		data += w;
+		len -= w;
 	}
 }
 
 
-static bool autoupdate(const char *mirror, struct settings *s, int lock_fd) {
-	bool ret = false;
-	struct recv_manifest_ctx manifest_ctx = { .s = s };
-	manifest_ctx.ptr = manifest_ctx.buf;
-	struct manifest *m = &manifest_ctx.m;
-	int interrupted = 0;
+/**
+	Maps the firmware file to memory, so the image is received directly into the file
 
-	/**** Get and check manifest *****************************************/
-	/* Construct manifest URL */
-	char manifest_url[strlen(mirror) + strlen(s->branch) + 11];
-	sprintf(manifest_url, "%s/%s.manifest", mirror, s->branch);
+	The file is extended to the full image size while it is mapped.
+*/
+static void image_map(struct recv_image_ctx *ctx) {
+	if (ftruncate(ctx->fd, ctx->m->imagesize))
+		goto err;
 
+	void *map = mmap(NULL, ctx->m->imagesize, PROT_READ|PROT_WRITE, MAP_SHARED, ctx->fd, 0);
+	if (map == MAP_FAILED)
+		goto err;
 
-	printf("Retrieving manifest from %s ...\n", manifest_url);
+	ctx->map = map;
+	return;
 
-	/* Download manifest */
-	ecdsa_sha256_init(&m->hash_ctx);
-	int err_code = get_url(manifest_url, recv_manifest_cb, &manifest_ctx, -1, s->old_version);
-	if (err_code != 0) {
-		fprintf(stderr, "autoupdater: warning: error downloading manifest: %s\n", uclient_get_errmsg(err_code));
-		interrupted = uclient_interrupted_signal(err_code);
-		goto out;
-	}
+err:
+	fputs("autoupdater: warning: failed to map firmware file, using buffered writes: ", stderr);
+	perror(NULL);
 
-	/* Check manifest signatures */
-	{
-		ecc_int256_t hash;
-		ecdsa_sha256_final(&m->hash_ctx, hash.p);
-		ecdsa_verify_context_t ctxs[m->n_signatures];
-		for (size_t i = 0; i < m->n_signatures; i++)
-			ecdsa_verify_prepare_legacy(&ctxs[i], &hash, m->signatures[i]);
+	if (ftruncate(ctx->fd, ctx->offset))
+		ctx->failed = true;
+}
 
-		long unsigned int good_signatures = ecdsa_verify_list_legacy(ctxs, m->n_signatures, s->pubkeys, s->n_pubkeys);
-		if (good_signatures < s->good_signatures) {
-			fprintf(stderr, "autoupdater: warning: manifest %s only carried %lu valid signatures, %lu are required\n", manifest_url, good_signatures, s->good_signatures);
-			goto out;
-		}
-	}
 
-	/* Check manifest */
-	if (!m->date_ok || !m->priority_ok) {
-		fprintf(stderr, "autoupdater: warning: manifest is missing mandatory fields\n");
-		goto out;
-	}
+/** Removes the mapping of the firmware file, cutting the file to the received data */
+static void image_unmap(struct recv_image_ctx *ctx) {
+	if (!ctx->map)
+		return;
 
-	if (!m->branch_ok) {
-		fprintf(stderr, "autoupdater: warning: manifest %s is not for branch %s\n", manifest_url, s->branch);
-		goto out;
-	}
+	munmap(ctx->map, ctx->m->imagesize);
+	ctx->map = NULL;
 
-	if (!m->model_ok) {
-		fprintf(stderr, "autoupdater: warning: no matching firmware found (model %s)\n", platforminfo_get_image_name());
-		goto out;
-	}
+	if (ftruncate(ctx->fd, ctx->offset) || lseek(ctx->fd, ctx->offset, SEEK_SET) != ctx->offset)
+		ctx->failed = true;
+}
 
-	/* Check version and update probability */
-	if (!newer_than(m->version, s->old_version) && !s->force_version) {
-		puts("No new firmware available.");
-		ret = true;
-		goto out;
-	}
 
-	if (!s->force && random() >= RAND_MAX * get_probability(m->date, m->priority, s->fallback)) {
-		fputs("autoupdater: info: no autoupdate this time. Use -f to override.\n", stderr);
-		ret = true;
-		goto out;
+/**
+	Writes the received data of a staged image to the storage and drops it from the page cache
+
+	This keeps the memory usage independent of the image size, and ensures
+	that the saved state never covers data that has been lost on a reboot.
+*/
+static bool image_sync(struct recv_image_ctx *ctx) {
+	if (fdatasync(ctx->fd)) {
+		fputs("autoupdater: error: failed to sync firmware file: ", stderr);
+		perror(NULL);
+		return false;
 	}
 
-	/**** Download and verify image file *********************************/
-	/* Begin download of the image */
-	run_dir(download_d_dir);
+	posix_fadvise(ctx->fd, 0, 0, POSIX_FADV_DONTNEED);
+	return true;
+}
 
-	struct recv_image_ctx image_ctx = { .downloaded = -1 };
-	image_ctx.fd = open(firmware_path, O_WRONLY|O_CREAT, 0600);
-	if (image_ctx.fd < 0) {
-		fprintf(stderr, "autoupdater: error: failed opening firmware file %s\n", firmware_path);
-		goto fail_after_download;
-	}
 
-	/* Download image and calculate SHA256 checksum */
-	{
-		char image_url[strlen(mirror) + strlen(m->image_filename) + 2];
-		sprintf(image_url, "%s/%s", mirror, m->image_filename);
-		ecdsa_sha256_init(&image_ctx.hash_ctx);
-		int err_code = get_url(image_url, &recv_image_cb, &image_ctx, m->imagesize, s->old_version);
-		puts("");
-		if (err_code != 0) {
-			fprintf(stderr, "autoupdater: warning: error downloading image: %s\n", uclient_get_errmsg(err_code));
-			interrupted = uclient_interrupted_signal(err_code);
-			close(image_ctx.fd);
-			goto fail_after_download;
-		}
+/** Saves the state of an incomplete download, so it can be resumed later */
+static void image_save_state(struct recv_image_ctx *ctx) {
+	if (ctx->offset == ctx->state_offset)
+		return;
+
+	if (ctx->staging && !image_sync(ctx))
+		return;
+
+	struct image_state state = {
+		.imagesize = ctx->m->imagesize,
+		.offset = ctx->offset,
+		.hash_ctx = ctx->hash_ctx,
+	};
+	memcpy(state.image_hash, ctx->m->image_hash, ECDSA_SHA256_HASH_SIZE);
+
+	int fd = open(firmware_state_path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd < 0)
+		return;
+
+	if (write(fd, &state, sizeof(state)) == sizeof(state))
+		ctx->state_offset = ctx->offset;
+
+	close(fd);
+}
+
+
+/**
+	Continues an incomplete download of the same image from a previous run
+
+	Anything left over from a download of a different image is discarded.
+*/
+static void image_resume(struct recv_image_ctx *ctx) {
+	struct image_state state;
+	struct stat st;
+	bool ok = false;
+
+	int fd = open(firmware_state_path, O_RDONLY);
+	if (fd >= 0) {
+		ok = read(fd, &state, sizeof(state)) == sizeof(state);
+		close(fd);
 	}
-	close(image_ctx.fd);
 
-	/* Verify image checksum */
-	{
-		ecc_int256_t hash;
-		ecdsa_sha256_final(&image_ctx.hash_ctx, hash.p);
-		if (memcmp(hash.p, m->image_hash, ECDSA_SHA256_HASH_SIZE)) {
-			fputs("autoupdater: warning: invalid image checksum!\n", stderr);
-			goto fail_after_download;
-		}
+	ok = ok &&
+		!memcmp(state.image_hash, ctx->m->image_hash, ECDSA_SHA256_HASH_SIZE) &&
+		state.imagesize == ctx->m->imagesize &&
+		state.offset > 0 && state.offset <= state.imagesize &&
+		!fstat(ctx->fd, &st) && st.st_size >= state.offset;
+
+	/* The file may contain data written after the state was saved */
+	ok = ok && !ftruncate(ctx->fd, state.offset) && lseek(ctx->fd, state.offset, SEEK_SET) == state.offset;
+
+	if (!ok) {
+		image_reset(ctx);
+		return;
 	}
 
-	/* Test the image upgrade (issue #193) */
-	{
-		static const char *const exec_builtin = "exec ";
-		static const char *const test_option = " --test ";
-		static const char *const compat_option = " --ignore-minor-compat-version ";
+	printf("Resuming image download at %.1f MiB\n", state.offset / (1024.0 * 1024.0));
 
-		char buf[strlen(exec_builtin) + strlen(sysupgrade_path) + strlen(test_option) + strlen(compat_option) + strlen(firmware_path) + 1];
-		strcpy(buf, exec_builtin);
-		strcat(buf, sysupgrade_path);
-		strcat(buf, test_option);
-		strcat(buf, compat_option);
-		strcat(buf, firmware_path);
+	ctx->hash_ctx = state.hash_ctx;
+	ctx->offset = state.offset;
+	ctx->state_offset = state.offset;
+}
 
-		const int sysupgrade_ret = system(buf);
-		if (WEXITSTATUS(sysupgrade_ret) != 0 ) {
-			fprintf(stderr, "autoupdater: warning: sysupgrade --test failed with return code: %d\n", WEXITSTATUS(sysupgrade_ret));
-			goto fail_after_download;
+
+/**
+	Receives data from uclient and writes it to file
+
+	The data is collected in chunks of buf_size bytes, which are written and
+	hashed at once.
+*/
+static void recv_image_cb(struct uclient *cl) {
+	struct recv_image_ctx *ctx = uclient_get_custom(cl);
+	struct uclient_data *d = uclient_data(cl);
+	int len;
+
+	while (true) {
+		/* The server has ignored the Range header and sends the whole image */
+		if (!d->downloaded && d->offset != ctx->offset)
+			image_reset(ctx);
+
+		char *dest = ctx->buf + ctx->buf_len;
+		size_t space = ctx->buf_size - ctx->buf_len;
+		if (ctx->map) {
+			dest = ctx->map + ctx->offset + ctx->buf_len;
+			if (space > (size_t)(ctx->m->imagesize - ctx->offset) - ctx->buf_len)
+				space = (ctx->m->imagesize - ctx->offset) - ctx->buf_len;
 		}
+
+		if (!space)
+			return;
+
+		len = uclient_read_account(cl, dest, space);
+		if (len <= 0)
+			return;
+
+		if (ctx->failed)
+			continue;
+
+		ctx->buf_len += len;
+		update_progress(ctx, d->offset + d->downloaded, d->offset + d->length);
+
+		if (ctx->buf_len < ctx->buf_size)
+			continue;
+
+		image_flush(ctx);
+
+		if (ctx->offset - ctx->state_offset >= IMAGE_STATE_INTERVAL)
+			image_save_state(ctx);
 	}
+}
 
-	clear_manifest(m);
 
-	/**** Call sysupgrade ************************************************/
-	if (s->no_action) {
-		printf(
-			"autoupdater: info: Aborting successful upgrade because simulation was requested.\n"
-			"autoupdater: info: You can find the firmware file in %s\n",
-			firmware_path
-		);
-		run_dir(abort_d_dir);
-		ret = true;
-		goto out;
+static bool is_zero(const ecc_int256_t *v) {
+	for (size_t i = 0; i < sizeof(v->p); i++) {
+		if (v->p[i])
+			return false;
 	}
 
-	/* Begin upgrade */
-	run_dir(upgrade_d_dir);
+	return true;
+}
 
-	/* Unset FD_CLOEXEC so the lockfile stays locked during sysupgrade */
-	fcntl(lock_fd, F_SETFD, 0);
 
-	execl(sysupgrade_path, sysupgrade_path, "--ignore-minor-compat-version", firmware_path, NULL);
+/**
+	Counts the public keys that have signed the manifest
 
-	/* execl() shouldn't return */
-	fputs("autoupdater: error: failed to call sysupgrade\n", stderr);
+	Unlike ecdsa_verify_list_legacy(), this stops as soon as the required
+	number of good signatures has been found, as every verification is
+	expensive on slow devices. Signatures that can't be valid (duplicates and
+	signatures with a zero component) are skipped, and a signature that has
+	matched a key isn't verified against the remaining keys.
+*/
+static unsigned long verify_signatures(const struct manifest *m, const struct settings *s, const ecc_int256_t *hash) {
+	if (!m->n_signatures)
+		return 0;
 
-	fcntl(lock_fd, F_SETFD, FD_CLOEXEC);
+	ecdsa_verify_context_t ctxs[m->n_signatures];
+	size_t n_ctxs = 0;
 
-fail_after_download:
-	unlink(firmware_path);
-	run_dir(abort_d_dir);
+	for (size_t i = 0; i < m->n_signatures; i++) {
+		const ecdsa_signature_t *sig = m->signatures[i];
+		bool skip = is_zero(&sig->r) || is_zero(&sig->s);
 
-out:
-	clear_manifest(m);
+		for (size_t j = 0; j < i && !skip; j++)
+			skip = !memcmp(sig, m->signatures[j], sizeof(*sig));
 
-	/* If we were interrupted by a signal, restore original signal handlers
-	 * and re-raise signal to terminate process */
-	if (interrupted) {
-		uloop_done();
-		raise(interrupted);
+		if (!skip)
+			ecdsa_verify_prepare_legacy(&ctxs[n_ctxs++], hash, sig);
 	}
 
-	return ret;
-}
+	bool used[m->n_signatures];
+	memset(used, 0, sizeof(used));
 
+	unsigned long good_signatures = 0;
+	for (size_t k = 0; k < s->n_pubkeys && good_signatures < s->good_signatures; k++) {
+		for (size_t i = 0; i < n_ctxs; i++) {
+			if (used[i] || !ecdsa_verify_legacy(&ctxs[i], &s->pubkeys[k]))
+				continue;
 
-static int lock_autoupdater(void) {
-	int fd = open(lockfile, O_CREAT|O_RDONLY|O_CLOEXEC, 0600);
-	if (fd < 0) {
-		fprintf(stderr, "autoupdater: error: unable to open lock file: %m\n");
-		return -1;
+			used[i] = true;
+			good_signatures++;
+			break;
+		}
 	}
 
-	if (flock(fd, LOCK_EX|LOCK_NB)) {
-		fputs("autoupdater: error: another instance is currently running\n", stderr);
-		close(fd);
-		return -1;
-	}
-	return fd;
+	return good_signatures;
 }
 
 
-int main(int argc, char *argv[]) {
-	struct settings s = { };
-	parse_args(argc, argv, &s);
+/** Checks the signatures and the mandatory fields of a downloaded manifest */
+static bool check_manifest(struct manifest *m, struct settings *s, const char *manifest_url, bool cached) {
+	/* Check manifest signatures (already done for cached manifests) */
+	if (!cached) {
+		int64_t start = get_monotonic_time_us();
 
-	if (!platforminfo_get_image_name()) {
-		fputs("autoupdater: error: unsupported hardware model\n", stderr);
-		return EXIT_FAILURE;
+		ecc_int256_t hash;
+		ecdsa_sha256_final(&m->hash_ctx, hash.p);
+
+		unsigned long good_signatures = verify_signatures(m, s, &hash);
+		report_add(&report.verify, start);
+
+		if (good_signatures < s->good_signatures) {
+			fprintf(stderr, "autoupdater: warning: manifest %s only carried %lu valid signatures, %lu are required\n", manifest_url, good_signatures, s->good_signatures);
+			return false;
+		}
 	}
 
-	bool external_mirrors = s.n_mirrors > 0;
-	load_settings(&s);
-	randomize();
+	/* Check manifest */
+	if (!m->date_ok || !m->priority_ok) {
+		fprintf(stderr, "autoupdater: warning: manifest %s is missing mandatory fields\n", manifest_url);
+		return false;
+	}
 
-	int lock_fd = lock_autoupdater();
-	if (lock_fd < 0)
-		return EXIT_FAILURE;
+	if (!m->branch_ok) {
+		fprintf(stderr, "autoupdater: warning: manifest %s is not for branch %s\n", manifest_url, s->branch);
+		return false;
+	}
 
-	uloop_init();
+	if (!m->model_ok) {
+		fprintf(stderr, "autoupdater: warning: no matching firmware found in manifest %s (model %s)\n", manifest_url, platforminfo_get_image_name());
+		return false;
+	}
 
-	size_t mirrors_left = s.n_mirrors;
-	while (mirrors_left) {
-		const char **mirror = s.mirrors;
-		size_t i = external_mirrors ? 0 : random() % mirrors_left;
+	return true;
+}
 
-		/* Move forward by i non-NULL entries */
-		while (true) {
-			while (!*mirror)
-				mirror++;
 
-			if (!i)
-				break;
+/**
+	Computes a fingerprint of the signature settings
 
-			mirror++;
-			i--;
-		}
+	A cached manifest is only used with the settings it has been verified with.
+*/
+static void manifest_cache_key(const struct settings *s, unsigned char key[ECDSA_SHA256_HASH_SIZE]) {
+	ecdsa_sha256_context_t hash_ctx;
+	ecdsa_sha256_init(&hash_ctx);
+	ecdsa_sha256_update(&hash_ctx, &s->good_signatures, sizeof(s->good_signatures));
+	ecdsa_sha256_update(&hash_ctx, s->pubkeys, s->n_pubkeys * sizeof(*s->pubkeys));
+	ecdsa_sha256_final(&hash_ctx, key);
+}
 
-		if (autoupdate(*mirror, &s, lock_fd)) {
-			// update the mtime of the lockfile to indicate a successful run
-			futimens(lock_fd, NULL);
 
-			return EXIT_SUCCESS;
-		}
+static void manifest_cache_free_entries(struct manifest_cache *cache) {
+	for (size_t i = 0; i < cache->n_entries; i++) {
+		free(cache->entries[i].url);
+		free(cache->entries[i].validators.etag);
+		free(cache->entries[i].validators.last_modified);
+	}
+
+	free(cache->entries);
+	cache->entries = NULL;
+	cache->n_entries = 0;
+}
+
+
+static void manifest_cache_clear(struct manifest_cache *cache) {
+	manifest_cache_free_entries(cache);
+	free(cache->data);
+	cache->data = NULL;
+	cache->len = 0;
+}
+
+
+/** Returns the validators for a mirror's manifest URL, or NULL */
+static struct uclient_validators * manifest_cache_lookup(struct manifest_cache *cache, const char *url) {
+	if (!cache->data)
+		return NULL;
+
+	for (size_t i = 0; i < cache->n_entries; i++) {
+		if (!strcmp(cache->entries[i].url, url))
+			return &cache->entries[i].validators;
+	}
+
+	return NULL;
+}
+
+
+/** Returns a copy of a string, or NULL for a missing or empty string */
+static char * strdup_nonempty(const char *str) {
+	return (str && *str) ? strdup(str) : NULL;
+}
+
+
+/**
+	Loads the cached manifest of the branch
+
+	The validators are stored one mirror per line as
+	"<manifest URL>\t<ETag>\t<Last-Modified>", following a line with the
+	fingerprint of the signature settings.
+*/
+static void manifest_cache_load(struct manifest_cache *cache, const struct settings *s) {
+	char path[strlen(manifest_cache_dir) + strlen(s->branch) + 13];
+	unsigned char key[ECDSA_SHA256_HASH_SIZE], cached_key[ECDSA_SHA256_HASH_SIZE];
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+
+	sprintf(path, "%s/%s.validators", manifest_cache_dir, s->branch);
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return;
+
+	manifest_cache_key(s, key);
+
+	len = getline(&line, &line_size, f);
+	if (len > 0 && line[len-1] == '\n')
+		line[len-1] = '\0';
+	if (len <= 0 || !parsehex(cached_key, line, sizeof(cached_key)) || memcmp(key, cached_key, sizeof(key))) {
+		fclose(f);
+		free(line);
+		return;
+	}
+
+	while ((len = getline(&line, &line_size, f)) > 0) {
+		if (line[len-1] == '\n')
+			line[len-1] = '\0';
+
+		char *etag = strchr(line, '\t');
+		char *last_modified = etag ? strchr(etag + 1, '\t') : NULL;
+		if (!last_modified)
+			continue;
+
+		*etag++ = '\0';
+		*last_modified++ = '\0';
+
+		cache->entries = safe_realloc(cache->entries, (cache->n_entries + 1) * sizeof(*cache->entries));
+		cache->entries[cache->n_entries++] = (struct manifest_cache_entry){
+			.url = strdup(line),
+			.validators = {
+				.etag = strdup_nonempty(etag),
+				.last_modified = strdup_nonempty(last_modified),
+			},
+		};
+	}
+
+	fclose(f);
+	free(line);
+
+	sprintf(path, "%s/%s.manifest", manifest_cache_dir, s->branch);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+
+	struct stat st;
+	if (!fstat(fd, &st) && st.st_size > 0) {
+		cache->data = safe_malloc(st.st_size);
+		cache->len = st.st_size;
+
+		if (read(fd, cache->data, cache->len) != (ssize_t)cache->len) {
+			free(cache->data);
+			cache->data = NULL;
+			cache->len = 0;
+		}
+	}
+
+	close(fd);
+}
+
+
+/** Replaces a file, so an interrupted write can't leave a truncated file behind */
+static bool write_file(const char *path, const char *data, size_t len) {
+	char tmp_path[strlen(path) + 5];
+	sprintf(tmp_path, "%s.tmp", path);
+
+	int fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd < 0)
+		return false;
+
+	bool ok = write(fd, data, len) == (ssize_t)len;
+	if (close(fd))
+		ok = false;
+
+	if (ok && !rename(tmp_path, path))
+		return true;
+
+	unlink(tmp_path);
+	return false;
+}
+
+
+/** Stores the cached manifest of the branch */
+static void manifest_cache_save(const struct manifest_cache *cache, const struct settings *s, bool changed) {
+	char manifest_path[strlen(manifest_cache_dir) + strlen(s->branch) + 11];
+	char validators_path[strlen(manifest_cache_dir) + strlen(s->branch) + 13];
+	sprintf(manifest_path, "%s/%s.manifest", manifest_cache_dir, s->branch);
+	sprintf(validators_path, "%s/%s.validators", manifest_cache_dir, s->branch);
+
+	char *validators = NULL;
+	size_t validators_len = 0;
+	FILE *f = open_memstream(&validators, &validators_len);
+	if (!f)
+		return;
+
+	unsigned char key[ECDSA_SHA256_HASH_SIZE];
+	manifest_cache_key(s, key);
+	for (size_t i = 0; i < sizeof(key); i++)
+		fprintf(f, "%02x", key[i]);
+	fputc('\n', f);
+
+	for (size_t i = 0; i < cache->n_entries; i++) {
+		const struct manifest_cache_entry *e = &cache->entries[i];
+		fprintf(f, "%s\t%s\t%s\n", e->url,
+			e->validators.etag ?: "", e->validators.last_modified ?: "");
+	}
+
+	fclose(f);
+
+	/* /var is a tmpfs on OpenWrt, so the directories may not exist yet */
+	mkdir("/var/cache", 0755);
+	mkdir(manifest_cache_dir, 0700);
+
+	bool ok = true;
+
+	/* The old validators must not be used with a new manifest if writing it fails */
+	if (changed) {
+		unlink(validators_path);
+		ok = write_file(manifest_path, cache->data, cache->len);
+	}
+
+	if (ok)
+		ok = write_file(validators_path, validators, validators_len);
+
+	if (!ok)
+		fputs("autoupdater: warning: failed to write manifest cache\n", stderr);
+
+	free(validators);
+}
+
+
+/**
+	Replaces the cache with the manifest that is used
+
+	Validators are kept for the mirrors known to serve this manifest: those
+	that have just sent it, and, if the manifest hasn't changed, those that
+	haven't sent anything else.
+*/
+static void manifest_cache_update(struct manifest_fetch *fetch, struct manifest_request *reqs) {
+	struct manifest_cache *cache = &fetch->cache;
+	struct recv_manifest_ctx *winner = &fetch->winner->ctx;
+
+	bool changed = !fetch->winner->cached &&
+		!(cache->data && winner->data_len == cache->len && !memcmp(winner->data, cache->data, cache->len));
+
+	const char *data = changed ? winner->data : cache->data;
+	size_t len = changed ? winner->data_len : cache->len;
+
+	size_t n_entries = 0;
+	struct manifest_cache_entry *entries = safe_malloc(fetch->s->n_mirrors * sizeof(*entries));
+
+	for (size_t i = 0; i < fetch->s->n_mirrors; i++) {
+		const struct manifest_request *req = &reqs[i];
+		const struct uclient_data *d = req->cl ? uclient_data(req->cl) : NULL;
+		bool received = d && d->done && !d->err_code && !d->not_modified;
+
+		if (received) {
+			if (req->ctx.data_len != len || memcmp(req->ctx.data, data, len))
+				continue;
+			if (!d->validators.etag && !d->validators.last_modified)
+				continue;
+
+			entries[n_entries++] = (struct manifest_cache_entry){
+				.url = strdup(req->url),
+				.validators = {
+					.etag = strdup_nonempty(d->validators.etag),
+					.last_modified = strdup_nonempty(d->validators.last_modified),
+				},
+			};
+		}
+		else if (!changed) {
+			struct uclient_validators *validators = manifest_cache_lookup(cache, req->url);
+			if (!validators)
+				continue;
+
+			/* Moved to the new entry */
+			entries[n_entries++] = (struct manifest_cache_entry){
+				.url = strdup(req->url),
+				.validators = *validators,
+			};
+			*validators = (struct uclient_validators){};
+		}
+	}
+
+	manifest_cache_free_entries(cache);
+	cache->entries = entries;
+	cache->n_entries = n_entries;
+
+	if (changed) {
+		free(cache->data);
+		cache->data = winner->data;
+		cache->len = winner->data_len;
+		winner->data = NULL;
+		winner->data_len = 0;
+		winner->data_size = 0;
+	}
+
+	manifest_cache_save(cache, fetch->s, changed);
+}
+
+
+/** Parses the cached manifest for a mirror that has reported it unchanged */
+static bool manifest_cache_parse(const struct manifest_cache *cache, struct recv_manifest_ctx *ctx) {
+	if (!cache->data) {
+		fputs("autoupdater: warning: received unexpected response for uncached manifest\n", stderr);
+		return false;
+	}
+
+	parse_manifest(ctx->parser, &ctx->m, cache->data, cache->len);
+	return true;
+}
+
+
+/**
+	Sets the URL of the manifest requested from a mirror
+
+	Per-model manifests are complete signed manifests that only contain the
+	lines for a single model. Their image filenames are relative to the
+	mirror like those of the full manifest.
+*/
+static void manifest_request_set_url(struct manifest_request *req) {
+	const struct settings *s = req->fetch->s;
+
+	free(req->url);
+
+	if (req->sharded) {
+		const char *image_name = req->fetch->parser.image_name;
+		req->url = safe_malloc(strlen(req->mirror) + strlen(s->branch) + strlen(image_name) + 12);
+		sprintf(req->url, "%s/%s/%s.manifest", req->mirror, s->branch, image_name);
+	}
+	else {
+		req->url = safe_malloc(strlen(req->mirror) + strlen(s->branch) + 11);
+		sprintf(req->url, "%s/%s.manifest", req->mirror, s->branch);
+	}
+}
+
+
+static void manifest_done_cb(struct uclient *cl);
+
+/** Starts the manifest request to a mirror, returning false on errors */
+static bool manifest_request_start(struct manifest_request *req) {
+	struct manifest_fetch *fetch = req->fetch;
+
+	printf("Retrieving manifest from %s ...\n", req->url);
+
+	ecdsa_sha256_init(&req->ctx.m.hash_ctx);
+	req->cl = get_url_async(req->url, recv_manifest_cb, manifest_done_cb, &req->ctx, 0, -1,
+		manifest_cache_lookup(&fetch->cache, req->url), fetch->s->old_version);
+	if (!req->cl) {
+		fprintf(stderr, "autoupdater: warning: error downloading manifest %s: %s\n", req->url, uclient_get_errmsg(UCLIENT_ERROR_CONNECT));
+		return false;
+	}
+
+	return true;
+}
+
+
+/** Requests the full manifest from a mirror that doesn't provide per-model manifests */
+static void manifest_fallback_cb(struct uloop_timeout *timeout) {
+	struct manifest_request *req = container_of(timeout, struct manifest_request, fallback);
+	struct manifest_fetch *fetch = req->fetch;
+
+	get_url_free(req->cl);
+	req->cl = NULL;
+
+	clear_manifest(&req->ctx.m);
+	free(req->ctx.data);
+	req->ctx.data = NULL;
+	req->ctx.data_len = req->ctx.data_size = req->ctx.parsed = 0;
+	req->ctx.too_large = false;
+
+	req->sharded = false;
+	manifest_request_set_url(req);
+
+	if (!manifest_request_start(req)) {
+		fetch->n_pending--;
+		if (!fetch->n_pending)
+			uloop_end();
+	}
+}
+
+
+/** Verifies a finished manifest request, ending the uloop when a valid manifest has been found */
+static void manifest_done_cb(struct uclient *cl) {
+	struct manifest_request *req = container_of(uclient_get_custom(cl), struct manifest_request, ctx);
+	struct manifest_fetch *fetch = req->fetch;
+	int err_code = uclient_data(cl)->err_code;
+
+	if (req->sharded && uclient_status_code(err_code) == 404) {
+		printf("No per-model manifest found at %s, falling back to full manifest\n", req->url);
+		uloop_timeout_set(&req->fallback, 0);
+		return;
+	}
+
+	fetch->n_pending--;
+
+	if (err_code) {
+		fprintf(stderr, "autoupdater: warning: error downloading manifest %s: %s\n", req->url, uclient_get_errmsg(err_code));
+	}
+	else if (req->ctx.too_large) {
+		fprintf(stderr, "autoupdater: warning: manifest %s exceeds size limit of %d bytes\n", req->url, MAX_MANIFEST_SIZE);
+	}
+	else if (uclient_data(cl)->not_modified) {
+		if (!fetch->winner && manifest_cache_parse(&fetch->cache, &req->ctx) &&
+		    check_manifest(&req->ctx.m, fetch->s, req->url, true)) {
+			req->cached = true;
+			fetch->winner = req;
+		}
+	}
+	else if (!fetch->winner && check_manifest(&req->ctx.m, fetch->s, req->url, false)) {
+		fetch->winner = req;
+	}
+
+	if (fetch->winner || !fetch->n_pending)
+		uloop_end();
+}
+
+
+/** Returns the time a mirror took to respond to the manifest request, or -1 */
+static int64_t manifest_latency(const struct manifest_request *req) {
+	if (!req->cl || !uclient_data(req->cl)->header_time)
+		return -1;
+
+	return uclient_data(req->cl)->header_time - uclient_data(req->cl)->start_time;
+}
+
+
+/**
+	Downloads the manifest from all mirrors concurrently
+
+	The first manifest that passes all checks is used, the remaining
+	requests are cancelled. The mirrors are stored in the order of their
+	response times, so the image is downloaded from the fastest mirror;
+	mirrors that have not responded come last.
+*/
+static bool fetch_manifest(struct settings *s, struct manifest *m, const char **ranking, int *interrupted) {
+	struct manifest_fetch fetch = { .s = s };
+	struct manifest_request reqs[s->n_mirrors];
+
+	manifest_parser_init(&fetch.parser, s->branch, platforminfo_get_image_name());
+	manifest_cache_load(&fetch.cache, s);
+
+	for (size_t i = 0; i < s->n_mirrors; i++) {
+		struct manifest_request *req = &reqs[i];
+		const char *mirror = s->mirrors[i];
+
+		*req = (struct manifest_request){
+			.ctx = { .s = s, .parser = &fetch.parser },
+			.fetch = &fetch,
+			.mirror = mirror,
+			.sharded = s->sharded_manifest,
+			.fallback.cb = manifest_fallback_cb,
+		};
+		manifest_request_set_url(req);
+
+		fetch.n_pending++;
+		if (!manifest_request_start(req))
+			fetch.n_pending--;
+	}
+
+	if (fetch.n_pending && !fetch.winner)
+		*interrupted = uloop_run();
+
+	/* Rank the mirrors by latency (stable insertion sort) */
+	size_t order[s->n_mirrors];
+	for (size_t i = 0; i < s->n_mirrors; i++) {
+		int64_t latency = manifest_latency(&reqs[i]);
+		size_t j = i;
+
+		if (latency >= 0) {
+			for (; j > 0; j--) {
+				int64_t prev = manifest_latency(&reqs[order[j-1]]);
+				if (prev >= 0 && prev <= latency)
+					break;
+
+				order[j] = order[j-1];
+			}
+		}
+
+		order[j] = i;
+	}
+
+	for (size_t i = 0; i < s->n_mirrors; i++)
+		ranking[i] = s->mirrors[order[i]];
+
+	if (fetch.winner) {
+		printf("Using manifest from %s%s\n", fetch.winner->url, fetch.winner->cached ? " (not modified)" : "");
+
+		manifest_cache_update(&fetch, reqs);
+
+		*m = fetch.winner->ctx.m;
+		memset(&fetch.winner->ctx.m, 0, sizeof(fetch.winner->ctx.m));
+	}
+
+	for (size_t i = 0; i < s->n_mirrors; i++) {
+		uloop_timeout_cancel(&reqs[i].fallback);
+		if (reqs[i].cl)
+			get_url_free(reqs[i].cl);
+
+		clear_manifest(&reqs[i].ctx.m);
+		free(reqs[i].ctx.data);
+		free(reqs[i].url);
+	}
+
+	manifest_cache_clear(&fetch.cache);
+
+	return fetch.winner;
+}
+
+
+/** Receives a segment of the image and writes it to its position in the file */
+static void recv_segment_cb(struct uclient *cl) {
+	struct segment_mirror *conn = uclient_get_custom(cl);
+	struct segmented_download *dl = conn->dl;
+	struct segment *seg = conn->segment;
+	char buf[1024];
+	int len;
+
+	while (true) {
+		len = uclient_read_account(cl, buf, sizeof(buf));
+		if (len <= 0)
+			return;
+
+		/* Discard the rest of a segment that couldn't be written */
+		if (conn->failed)
+			continue;
+
+		if (pwrite(dl->image->fd, buf, len, seg->pos) < len) {
+			fputs("autoupdater: error: downloading firmware image failed: ", stderr);
+			perror(NULL);
+			conn->failed = true;
+			continue;
+		}
+
+		seg->pos += len;
+		dl->written += len;
+		update_progress(dl->image, dl->image->offset + dl->written, dl->image->m->imagesize);
+	}
+}
+
+
+static void segment_done_cb(struct uclient *cl);
+
+/** Requests the next segment nobody is working on from a mirror */
+static void segment_start(struct segment_mirror *conn) {
+	struct segmented_download *dl = conn->dl;
+	const struct manifest *m = dl->image->m;
+	struct segment *seg = NULL;
+
+	for (size_t i = 0; i < dl->n_segments; i++) {
+		if (!dl->segments[i].active && !dl->segments[i].done) {
+			seg = &dl->segments[i];
+			break;
+		}
+	}
+
+	if (!seg)
+		return;
+
+	char image_url[strlen(conn->mirror) + strlen(m->image_filename) + 2];
+	sprintf(image_url, "%s/%s", conn->mirror, m->image_filename);
+
+	seg->pos = seg->start;
+	conn->cl = get_url_async(image_url, recv_segment_cb, segment_done_cb, conn, seg->start, seg->end - seg->start, NULL, dl->s->old_version);
+	if (!conn->cl) {
+		fprintf(stderr, "\nautoupdater: warning: error downloading image segment from %s: %s\n", conn->mirror, uclient_get_errmsg(UCLIENT_ERROR_CONNECT));
+		conn->failed = true;
+		return;
+	}
+
+	/* A mirror sending the whole image is of no use here */
+	uclient_data(conn->cl)->range_only = true;
+
+	seg->active = true;
+	conn->segment = seg;
+	dl->n_active++;
+}
+
+
+/**
+	Handles a finished segment request
+
+	A failed segment is given back to the other mirrors, and the failed
+	mirror isn't used any more.
+*/
+static void segment_done_cb(struct uclient *cl) {
+	struct segment_mirror *conn = uclient_get_custom(cl);
+	struct segmented_download *dl = conn->dl;
+	struct segment *seg = conn->segment;
+	int err_code = uclient_data(cl)->err_code;
+
+	seg->active = false;
+	conn->segment = NULL;
+	dl->n_active--;
+
+	if (err_code || conn->failed) {
+		if (err_code)
+			fprintf(stderr, "\nautoupdater: warning: error downloading image segment from %s: %s\n", conn->mirror, uclient_get_errmsg(err_code));
+
+		dl->written -= seg->pos - seg->start;
+		conn->failed = true;
+	}
+	else {
+		seg->done = true;
+	}
+
+	/* The request can't be freed from its own callback */
+	uloop_timeout_set(&conn->next, 0);
+}
+
+
+/** Frees a finished segment request and keeps the idle mirrors busy */
+static void segment_next_cb(struct uloop_timeout *t) {
+	struct segment_mirror *conn = container_of(t, struct segment_mirror, next);
+	struct segmented_download *dl = conn->dl;
+
+	get_url_free(conn->cl);
+	conn->cl = NULL;
+
+	for (size_t i = 0; i < dl->n_mirrors; i++) {
+		struct segment_mirror *c = &dl->mirrors[i];
+		if (!c->cl && !c->failed)
+			segment_start(c);
+	}
+
+	if (!dl->n_active)
+		uloop_end();
+}
+
+
+/** Adds the given part of the firmware file to the image hash */
+static bool image_hash_file(struct recv_image_ctx *ctx, ssize_t end) {
+	char buf[4096];
+
+	while (ctx->offset < end) {
+		size_t len = end - ctx->offset;
+		if (len > sizeof(buf))
+			len = sizeof(buf);
+
+		ssize_t r = pread(ctx->fd, buf, len, ctx->offset);
+		if (r <= 0) {
+			fputs("autoupdater: error: failed to read firmware file: ", stderr);
+			perror(NULL);
+			return false;
+		}
+
+		image_hash_update(&ctx->hash_ctx, buf, r);
+		ctx->offset += r;
+	}
+
+	return true;
+}
+
+
+/**
+	Downloads the remaining part of the image in segments from the fastest mirrors
+
+	Each mirror requests the next free segment when it has finished one, so
+	faster mirrors download more segments. The segments completed from the
+	start of the remaining part are hashed and kept; the image is completed
+	and verified by download_image() afterwards.
+*/
+static void download_segmented(struct recv_image_ctx *ctx, const char **mirrors, struct settings *s, int *interrupted) {
+	const struct manifest *m = ctx->m;
+	size_t n_mirrors = s->n_mirrors < MAX_SEGMENT_MIRRORS ? s->n_mirrors : MAX_SEGMENT_MIRRORS;
+	struct segmented_download dl = {
+		.image = ctx,
+		.s = s,
+		.n_segments = (m->imagesize - ctx->offset + SEGMENT_SIZE - 1) / SEGMENT_SIZE,
+		.n_mirrors = n_mirrors,
+	};
+
+	if (dl.n_segments < 2 || n_mirrors < 2)
+		return;
+
+	dl.segments = safe_malloc(dl.n_segments * sizeof(*dl.segments));
+	for (size_t i = 0; i < dl.n_segments; i++) {
+		ssize_t start = ctx->offset + i * SEGMENT_SIZE;
+		ssize_t end = start + SEGMENT_SIZE;
+
+		dl.segments[i] = (struct segment){
+			.start = start,
+			.end = end < m->imagesize ? end : m->imagesize,
+		};
+	}
+
+	struct segment_mirror conns[n_mirrors];
+	dl.mirrors = conns;
+	for (size_t i = 0; i < n_mirrors; i++) {
+		conns[i] = (struct segment_mirror){
+			.dl = &dl,
+			.mirror = mirrors[i],
+			.next = { .cb = segment_next_cb },
+		};
+	}
+
+	printf("Retrieving image in %zu segments from %zu mirrors ...\n", dl.n_segments, n_mirrors);
+
+	ctx->downloaded = -1;
+	for (size_t i = 0; i < n_mirrors; i++)
+		segment_start(&conns[i]);
+
+	if (dl.n_active)
+		*interrupted = uloop_run();
+
+	puts("");
+
+	for (size_t i = 0; i < n_mirrors; i++) {
+		uloop_timeout_cancel(&conns[i].next);
+		if (conns[i].cl)
+			get_url_free(conns[i].cl);
+	}
+
+	ssize_t end = ctx->offset;
+	for (size_t i = 0; i < dl.n_segments && dl.segments[i].done; i++)
+		end = dl.segments[i].end;
+
+	free(dl.segments);
+
+	/* Segments following a missing one are downloaded again */
+	if (!image_hash_file(ctx, end)) {
+		image_reset(ctx);
+		return;
+	}
+
+	if (ftruncate(ctx->fd, ctx->offset) || lseek(ctx->fd, ctx->offset, SEEK_SET) != ctx->offset) {
+		image_reset(ctx);
+		return;
+	}
+
+	image_save_state(ctx);
+}
+
+
+/**
+	Prepares the staging directory for the image download
+
+	Fails if the remaining part of the image doesn't fit on the storage. The
+	space is reserved in advance where the filesystem supports it.
+*/
+static bool image_stage(struct recv_image_ctx *ctx) {
+	ssize_t remaining = ctx->m->imagesize - ctx->offset;
+	struct statvfs st;
+
+	if (fstatvfs(ctx->fd, &st)) {
+		fputs("autoupdater: error: failed to determine free space in staging directory: ", stderr);
+		perror(NULL);
+		return false;
+	}
+
+	if ((uint64_t)st.f_bavail * st.f_frsize < (uint64_t)remaining) {
+		fprintf(stderr, "autoupdater: error: not enough space in staging directory for the image (%.1f MiB needed)\n",
+			remaining / (1024.0 * 1024.0));
+		return false;
+	}
+
+	/* Not supported by all filesystems (e.g. JFFS2 and UBIFS), so errors are ignored */
+	if (remaining > 0)
+		fallocate(ctx->fd, FALLOC_FL_KEEP_SIZE, ctx->offset, remaining);
+
+	return true;
+}
+
+
+/**
+	Copies a file, hashing its contents if hash_ctx is given
+
+	On errors, errno is left set for the failed operation.
+*/
+static bool copy_file(const char *src, const char *dst, size_t chunk_size, ecdsa_sha256_context_t *hash_ctx) {
+	bool ok = false;
+	char *buf = NULL;
+	int out = -1;
+
+	int in = open(src, O_RDONLY);
+	if (in < 0)
+		return false;
+
+	out = open(dst, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (out < 0)
+		goto out;
+
+	buf = safe_malloc(chunk_size);
+
+	while (true) {
+		ssize_t r = read(in, buf, chunk_size);
+		if (r < 0)
+			goto out;
+		if (!r)
+			break;
+
+		if (hash_ctx)
+			ecdsa_sha256_update(hash_ctx, buf, r);
+
+		for (ssize_t pos = 0; pos < r;) {
+			ssize_t w = write(out, buf + pos, r - pos);
+			if (w < 0)
+				goto out;
+			pos += w;
+		}
+
+		posix_fadvise(in, 0, 0, POSIX_FADV_DONTNEED);
+	}
+
+	ok = true;
+
+out:
+	if (out >= 0 && close(out))
+		ok = false;
+	close(in);
+	free(buf);
+
+	return ok;
+}
+
+
+/**
+	Copies the verified image from the staging directory to /tmp for sysupgrade
+
+	The staging storage may be overwritten while the image is written to the
+	flash, so sysupgrade can't read it from there. The checksum is verified
+	again while copying, so corruption on the storage can't go unnoticed.
+*/
+static bool copy_staged_image(const unsigned char *image_hash, size_t chunk_size) {
+	ecdsa_sha256_context_t hash_ctx;
+	ecdsa_sha256_init(&hash_ctx);
+
+	if (!copy_file(firmware_path, tmp_firmware_path, chunk_size, &hash_ctx)) {
+		fputs("autoupdater: error: failed to copy staged image: ", stderr);
+		perror(NULL);
+		unlink(tmp_firmware_path);
+		return false;
+	}
+
+	ecc_int256_t hash;
+	ecdsa_sha256_final(&hash_ctx, hash.p);
+	if (memcmp(hash.p, image_hash, ECDSA_SHA256_HASH_SIZE)) {
+		fputs("autoupdater: warning: invalid checksum of staged image!\n", stderr);
+		unlink(tmp_firmware_path);
+		return false;
+	}
+
+	return true;
+}
+
+
+/** Checks if the staging directory holds the tested image of the manifest from an earlier run */
+static bool image_staged(const struct manifest *m) {
+	unsigned char image_hash[ECDSA_SHA256_HASH_SIZE];
+	struct stat st;
+	bool ok;
+
+	int fd = open(firmware_verified_path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	ok = read(fd, image_hash, sizeof(image_hash)) == sizeof(image_hash);
+	close(fd);
+
+	return ok &&
+		!memcmp(image_hash, m->image_hash, ECDSA_SHA256_HASH_SIZE) &&
+		!stat(firmware_path, &st) && st.st_size == m->imagesize;
+}
+
+
+/** Removes the images provided to other nodes */
+static void image_unshare(const struct settings *s) {
+	if (!s->share_dir)
+		return;
+
+	char pat[strlen(s->share_dir) + 7];
+	sprintf(pat, "%s/*.bin", s->share_dir);
+
+	glob_t globbuf;
+	if (glob(pat, 0, NULL, &globbuf))
+		return;
+
+	for (size_t i = 0; i < globbuf.gl_pathc; i++)
+		unlink(globbuf.gl_pathv[i]);
+
+	globfree(&globbuf);
+}
+
+
+/**
+	Provides the tested staged image to other nodes
+
+	A link named after the checksum of the image is created in share_dir,
+	which is expected to be served by a web server. A hard link is used if
+	share_dir is on the same filesystem as the staging directory, as web
+	servers like uhttpd don't follow symlinks out of their document root.
+*/
+static void image_share(const struct settings *s, const struct manifest *m) {
+	if (!s->share_dir)
+		return;
+
+	image_unshare(s);
+	mkdir(s->share_dir, 0755);
+
+	char hash[2*ECDSA_SHA256_HASH_SIZE + 1];
+	formathex(hash, m->image_hash, ECDSA_SHA256_HASH_SIZE);
+
+	char path[strlen(s->share_dir) + strlen(hash) + 6];
+	sprintf(path, "%s/%s.bin", s->share_dir, hash);
+
+	if (link(firmware_path, path) && (errno != EXDEV || symlink(firmware_path, path))) {
+		fprintf(stderr, "autoupdater: warning: failed to share image as %s: ", path);
+		perror(NULL);
+	}
+}
+
+
+/** Keeps a copy of the image that is about to be flashed as base for the next delta update */
+static void store_delta_base(const char *path, size_t chunk_size) {
+	char tmp_path[strlen(path) + 5];
+	sprintf(tmp_path, "%s.tmp", path);
+
+	if (copy_file(tmp_firmware_path, tmp_path, chunk_size, NULL) && !rename(tmp_path, path))
+		return;
+
+	fputs("autoupdater: warning: failed to store base image for delta updates: ", stderr);
+	perror(NULL);
+	unlink(tmp_path);
+}
+
+
+/** Computes the SHA256 checksum of a file, returning its size or -1 on errors */
+static ssize_t hash_file(const char *path, unsigned char hash[ECDSA_SHA256_HASH_SIZE]) {
+	char buf[4096];
+	ssize_t size = 0, r;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	ecdsa_sha256_context_t hash_ctx;
+	ecdsa_sha256_init(&hash_ctx);
+
+	while ((r = read(fd, buf, sizeof(buf))) > 0) {
+		image_hash_update(&hash_ctx, buf, r);
+		size += r;
+	}
+
+	close(fd);
+
+	if (r < 0)
+		return -1;
+
+	ecdsa_sha256_final(&hash_ctx, hash);
+	return size;
+}
+
+
+static void recv_delta_cb(struct uclient *cl) {
+	struct recv_delta_ctx *ctx = uclient_get_custom(cl);
+	char buf[4096];
+	int len;
+
+	while ((len = uclient_read_account(cl, buf, sizeof(buf))) > 0) {
+		if (ctx->failed)
+			continue;
+
+		image_hash_update(&ctx->hash_ctx, buf, len);
+
+		for (int pos = 0; pos < len;) {
+			ssize_t w = write(ctx->fd, buf + pos, len - pos);
+			if (w < 0) {
+				fputs("autoupdater: error: downloading delta failed: ", stderr);
+				perror(NULL);
+				ctx->failed = true;
+				break;
+			}
+			pos += w;
+		}
+	}
+}
+
+
+/** Downloads a delta from one of the mirrors, verifying its checksum */
+static bool download_delta_file(const struct manifest_delta *delta, const char *path, const char **mirrors, struct settings *s, int *interrupted) {
+	for (size_t i = 0; i < s->n_mirrors && !*interrupted; i++) {
+		char url[strlen(mirrors[i]) + strlen(delta->filename) + 2];
+		sprintf(url, "%s/%s", mirrors[i], delta->filename);
+		printf("Retrieving delta from %s ...\n", url);
+
+		struct recv_delta_ctx ctx = {};
+		ctx.fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+		if (ctx.fd < 0) {
+			fprintf(stderr, "autoupdater: error: failed opening delta file %s\n", path);
+			return false;
+		}
+		ecdsa_sha256_init(&ctx.hash_ctx);
+
+		int err_code = get_url(url, &recv_delta_cb, &ctx, 0, delta->size, s->old_version);
+		if (close(ctx.fd))
+			ctx.failed = true;
+
+		if (err_code) {
+			fprintf(stderr, "autoupdater: warning: error downloading delta: %s\n", uclient_get_errmsg(err_code));
+			*interrupted = uclient_interrupted_signal(err_code);
+			continue;
+		}
+		if (ctx.failed)
+			return false;
+
+		ecc_int256_t hash;
+		ecdsa_sha256_final(&ctx.hash_ctx, hash.p);
+		if (!memcmp(hash.p, delta->hash, ECDSA_SHA256_HASH_SIZE))
+			return true;
+
+		fputs("autoupdater: warning: invalid delta checksum!\n", stderr);
+	}
+
+	return false;
+}
+
+
+/** Reconstructs the image from the base image and a delta using bspatch */
+static bool apply_delta(const char *base, const char *delta) {
+	pid_t pid = fork();
+	if (pid < 0) {
+		fputs("autoupdater: warning: failed to fork: ", stderr);
+		perror(NULL);
+		return false;
+	}
+
+	if (pid == 0) {
+		execl(bspatch_path, bspatch_path, base, firmware_path, delta, (char *)NULL);
+		exit(EXIT_FAILURE);
+	}
+
+	int wstatus;
+	if (waitpid(pid, &wstatus, 0) != pid || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus)) {
+		fprintf(stderr, "autoupdater: warning: failed to apply delta using %s\n", bspatch_path);
+		return false;
+	}
+
+	return true;
+}
+
+
+/**
+	Reconstructs the image from a delta to the base image, if the manifest contains one
+
+	The reconstructed image must match the size and checksum of the full
+	image; on any failure, the full image is downloaded instead.
+*/
+static bool download_delta(const struct manifest *m, const char **mirrors, struct settings *s, int *interrupted) {
+	/* bspatch is an optional dependency, only needed for delta updates */
+	if (access(bspatch_path, X_OK)) {
+		fprintf(stderr, "autoupdater: warning: %s not found, downloading full image instead of delta\n", bspatch_path);
+		return false;
+	}
+
+	unsigned char base_hash[ECDSA_SHA256_HASH_SIZE];
+	if (hash_file(s->delta_base, base_hash) < 0)
+		return false;
+
+	const struct manifest_delta *delta = NULL;
+	for (size_t i = 0; i < m->n_deltas && !delta; i++) {
+		if (!memcmp(m->deltas[i].base_hash, base_hash, ECDSA_SHA256_HASH_SIZE))
+			delta = &m->deltas[i];
+	}
+
+	if (!delta) {
+		puts("No delta available for the base image, downloading full image.");
+		return false;
+	}
+
+	char delta_path[strlen(firmware_path) + 7];
+	sprintf(delta_path, "%s.delta", firmware_path);
+
+	bool ok = download_delta_file(delta, delta_path, mirrors, s, interrupted) &&
+		apply_delta(s->delta_base, delta_path);
+	unlink(delta_path);
+
+	if (ok) {
+		unsigned char hash[ECDSA_SHA256_HASH_SIZE];
+		ok = hash_file(firmware_path, hash) == m->imagesize &&
+			!memcmp(hash, m->image_hash, ECDSA_SHA256_HASH_SIZE);
+
+		if (!ok)
+			fputs("autoupdater: warning: invalid checksum of reconstructed image!\n", stderr);
+	}
+
+	if (!ok) {
+		unlink(firmware_path);
+		if (!*interrupted)
+			puts("Falling back to full image download.");
+	}
+
+	return ok;
+}
+
+
+/**
+	Downloads the image from a mirror and verifies its checksum
+
+	Downloads are continued where the previous attempt has stopped. An
+	image with an invalid checksum is discarded completely.
+*/
+static bool download_image_url(const char *image_url, struct recv_image_ctx *ctx, struct settings *s, int *interrupted) {
+	const struct manifest *m = ctx->m;
+
+	/* Download image and calculate SHA256 checksum */
+	if (ctx->offset < m->imagesize) {
+		printf("Retrieving image from %s ...\n", image_url);
+
+		ctx->downloaded = -1;
+		ctx->failed = false;
+		if (s->mmap && !ctx->staging)
+			image_map(ctx);
+
+		int err_code = get_url(image_url, &recv_image_cb, ctx, ctx->offset, m->imagesize - ctx->offset, s->old_version);
+		puts("");
+
+		if (!ctx->failed)
+			image_flush(ctx);
+		image_unmap(ctx);
+
+		if (ctx->failed) {
+			image_reset(ctx);
+			return false;
+		}
+
+		image_save_state(ctx);
+
+		if (err_code != 0) {
+			fprintf(stderr, "autoupdater: warning: error downloading image: %s\n", uclient_get_errmsg(err_code));
+			*interrupted = uclient_interrupted_signal(err_code);
+			return false;
+		}
+	}
+
+	/* Verify image size and checksum */
+	{
+		ecdsa_sha256_context_t hash_ctx = ctx->hash_ctx;
+		ecc_int256_t hash;
+		ecdsa_sha256_final(&hash_ctx, hash.p);
+		if (ctx->offset != m->imagesize || memcmp(hash.p, m->image_hash, ECDSA_SHA256_HASH_SIZE)) {
+			fputs("autoupdater: warning: invalid image checksum!\n", stderr);
+			image_reset(ctx);
+			return false;
+		}
+	}
+
+	unlink(firmware_state_path);
+	return true;
+}
+
+
+static bool download_image(const char *mirror, struct recv_image_ctx *ctx, struct settings *s, int *interrupted) {
+	const struct manifest *m = ctx->m;
+
+	char image_url[strlen(mirror) + strlen(m->image_filename) + 2];
+	sprintf(image_url, "%s/%s", mirror, m->image_filename);
+
+	return download_image_url(image_url, ctx, s, interrupted);
+}
+
+
+/** Returns the configured peers and those printed by peer_command in random order */
+static char ** get_peers(const struct settings *s, size_t *n_peers) {
+	char **peers = NULL;
+	size_t n = 0;
+
+	for (size_t i = 0; i < s->n_peers; i++) {
+		peers = safe_realloc(peers, (n + 1) * sizeof(*peers));
+		peers[n++] = strdup(s->peers[i]);
+	}
+
+	FILE *f = s->peer_command ? popen(s->peer_command, "r") : NULL;
+	if (f) {
+		char *line = NULL;
+		size_t len = 0;
+		ssize_t r;
+
+		while ((r = getline(&line, &len, f)) >= 0) {
+			if (r && line[r-1] == '\n')
+				line[r-1] = 0;
+			if (!*line)
+				continue;
+
+			peers = safe_realloc(peers, (n + 1) * sizeof(*peers));
+			peers[n++] = strdup(line);
+		}
+
+		free(line);
+		pclose(f);
+	}
+	else if (s->peer_command) {
+		fprintf(stderr, "autoupdater: warning: failed to run %s\n", s->peer_command);
+	}
+
+	/* Spread the requests of all nodes over the peers */
+	for (size_t i = n; i > 1; i--) {
+		size_t j = random() % i;
+		char *tmp = peers[i-1];
+		peers[i-1] = peers[j];
+		peers[j] = tmp;
+	}
+
+	*n_peers = n;
+	return peers;
+}
+
+
+/**
+	Tries to download the image from other nodes
+
+	Peers provide images they have downloaded themselves as <peer>/<sha256sum>.bin.
+	The image is verified against the manifest just like an image from a mirror.
+*/
+static bool download_image_peers(struct recv_image_ctx *ctx, struct settings *s, int *interrupted) {
+	size_t n_peers;
+	char **peers = get_peers(s, &n_peers);
+	bool downloaded = false;
+
+	char hash[2*ECDSA_SHA256_HASH_SIZE + 1];
+	formathex(hash, ctx->m->image_hash, ECDSA_SHA256_HASH_SIZE);
+
+	/* Unreachable peers shouldn't delay the download from the mirrors much */
+	get_url_set_timeout(PEER_TIMEOUT);
+
+	for (size_t i = 0; i < n_peers && !downloaded && !*interrupted; i++) {
+		char image_url[strlen(peers[i]) + strlen(hash) + 6];
+		sprintf(image_url, "%s/%s.bin", peers[i], hash);
+
+		downloaded = download_image_url(image_url, ctx, s, interrupted);
+	}
+
+	get_url_set_timeout(0);
+
+	for (size_t i = 0; i < n_peers; i++)
+		free(peers[i]);
+	free(peers);
+
+	return downloaded;
+}
+
+
+static void report_init(void) {
+	report = (struct run_report){
+		.time = time(NULL),
+		.result = "no_manifest",
+		.manifest = -1,
+		.verify = -1,
+		.download = -1,
+		.hash = -1,
+		.test = -1,
+		.download_hooks = -1,
+		.upgrade_hooks = -1,
+		.abort_hooks = -1,
+	};
+}
+
+
+static void json_string(FILE *f, const char *str) {
+	fputc('"', f);
+
+	for (; *str; str++) {
+		unsigned char c = *str;
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+
+	fputc('"', f);
+}
+
+
+static void json_duration(FILE *f, bool *first, const char *name, int64_t duration) {
+	if (duration < 0)
+		return;
+
+	fprintf(f, "%s\"%s\":%"PRId64, *first ? "" : ",", name, duration / 1000);
+	*first = false;
+}
+
+
+/**
+	Writes the run report as JSON
+
+	Durations are given in milliseconds, the download rate in bytes per second.
+*/
+static void report_write(const struct settings *s) {
+	char *json = NULL;
+	size_t json_len = 0;
+	FILE *f = open_memstream(&json, &json_len);
+	if (!f)
+		return;
+
+	fprintf(f, "{\"time\":%lld,\"result\":", (long long)report.time);
+	json_string(f, report.result);
+
+	if (s->old_version) {
+		fputs(",\"old_version\":", f);
+		json_string(f, s->old_version);
+	}
+	if (report.version) {
+		fputs(",\"new_version\":", f);
+		json_string(f, report.version);
+	}
+
+	bool first = true;
+	fputs(",\"durations\":{", f);
+	json_duration(f, &first, "connect", uclient_stats.connections ? uclient_stats.connect_time : -1);
+	json_duration(f, &first, "manifest", report.manifest);
+	json_duration(f, &first, "verify", report.verify);
+	json_duration(f, &first, "download", report.download);
+	json_duration(f, &first, "hash", report.hash);
+	json_duration(f, &first, "test", report.test);
+	json_duration(f, &first, "download_hooks", report.download_hooks);
+	json_duration(f, &first, "upgrade_hooks", report.upgrade_hooks);
+	json_duration(f, &first, "abort_hooks", report.abort_hooks);
+	fputc('}', f);
+
+	if (report.n_hooks) {
+		fputs(",\"hooks\":[", f);
+		for (size_t i = 0; i < report.n_hooks; i++) {
+			fputs(i ? ",{\"path\":" : "{\"path\":", f);
+			json_string(f, report.hooks[i].path);
+			fprintf(f, ",\"duration\":%"PRId64",\"timed_out\":%s}",
+				report.hooks[i].duration / 1000, report.hooks[i].timed_out ? "true" : "false");
+		}
+		fputc(']', f);
+	}
+
+	if (report.download >= 0) {
+		fprintf(f, ",\"download\":{\"bytes\":%"PRId64",\"rate\":%"PRId64"}",
+			report.download_bytes,
+			report.download > 0 ? report.download_bytes * 1000000 / report.download : 0);
+	}
+
+	fprintf(f, ",\"connections\":%u}\n", uclient_stats.connections);
+
+	fclose(f);
+
+	if (!write_file(report_path, json, json_len))
+		fprintf(stderr, "autoupdater: warning: failed to write run report %s\n", report_path);
+
+	free(json);
+}
+
+
+static bool autoupdate(struct settings *s, int lock_fd) {
+	bool ret = false;
+	struct manifest manifest = {};
+	struct manifest *m = &manifest;
+	const char *mirrors[s->n_mirrors];
+	int interrupted = 0;
+
+	report_init();
+
+	/**** Get and check manifest *****************************************/
+	int64_t manifest_start = get_monotonic_time_us();
+	bool manifest_ok = fetch_manifest(s, m, mirrors, &interrupted);
+	report_add(&report.manifest, manifest_start);
+
+	/* Manifests are verified as they arrive; that time is reported as "verify" only */
+	if (report.verify > 0)
+		report.manifest -= report.verify;
+	if (!manifest_ok)
+		goto out;
+
+	report.version = strdup(m->version);
+
+	/* Check version and update probability */
+	if (!newer_than(m->version, s->old_version) && !s->force_version) {
+		puts("No new firmware available.");
+		report.result = "up_to_date";
+		ret = true;
+		goto out;
+	}
+
+	/* Images are downloaded in advance regardless of the priority; the later run decides when to flash */
+	if (!s->force && !s->download_only && random() >= RAND_MAX * get_probability(m->date, m->priority, s->fallback)) {
+		fputs("autoupdater: info: no autoupdate this time. Use -f to override.\n", stderr);
+		report.result = "deferred";
+		ret = true;
+		goto out;
+	}
+
+	/**** Download and verify image file *********************************/
+	report.result = "download_failed";
+
+	bool downloaded = firmware_verified_path && image_staged(m);
+	if (downloaded) {
+		image_share(s, m);
+
+		if (s->download_only) {
+			puts("The new firmware has already been downloaded.");
+			report.result = "staged";
+			ret = true;
+			goto out;
+		}
+
+		puts("Using the previously downloaded firmware.");
+	}
+	else if (firmware_verified_path) {
+		image_unshare(s);
+		unlink(firmware_verified_path);
+	}
+
+	/*
+		Begin download of the image
+
+		The download.d scripts make room for the image in RAM, which isn't
+		needed when the image is downloaded to the staging directory in advance.
+	*/
+	if (!s->download_only)
+		run_hooks(s, download_d_dir, &report.download_hooks);
+
+	int64_t download_start = get_monotonic_time_us();
+	int64_t received = uclient_stats.received;
+
+	if (s->staging_dir)
+		mkdir(s->staging_dir, 0700);
+
+	/* Deltas aren't used while an incomplete download of the full image can be resumed */
+	if (!downloaded && s->delta_base && m->n_deltas && access(firmware_state_path, F_OK))
+		downloaded = download_delta(m, mirrors, s, &interrupted);
+
+	if (!downloaded && !interrupted) {
+		struct recv_image_ctx image_ctx = {
+			.m = m,
+			.buf = safe_malloc(s->chunk_size),
+			.buf_size = s->chunk_size,
+			.staging = s->staging_dir,
+		};
+		image_ctx.fd = open(firmware_path, O_RDWR|O_CREAT, 0600);
+		if (image_ctx.fd < 0) {
+			fprintf(stderr, "autoupdater: error: failed opening firmware file %s\n", firmware_path);
+			free(image_ctx.buf);
+			goto fail_after_download;
+		}
+
+		image_resume(&image_ctx);
+
+		if (image_ctx.staging && !image_stage(&image_ctx)) {
+			close(image_ctx.fd);
+			free(image_ctx.buf);
+			if (image_ctx.offset)
+				goto abort_download;
+			goto fail_after_download;
+		}
+
+		/* Nodes nearby may have downloaded the image already, which saves uplink bandwidth */
+		if (s->n_peers || s->peer_command)
+			downloaded = download_image_peers(&image_ctx, s, &interrupted);
+
+		if (s->segmented && !downloaded && !interrupted)
+			download_segmented(&image_ctx, mirrors, s, &interrupted);
+
+		/* Try the mirrors in the order of their latency */
+		for (size_t i = 0; i < s->n_mirrors && !downloaded && !interrupted; i++)
+			downloaded = download_image(mirrors[i], &image_ctx, s, &interrupted);
+
+		close(image_ctx.fd);
+		free(image_ctx.buf);
+
+		/*
+			Keep an incomplete download on persistent storage, so the next
+			run can resume it; in /tmp, it would hold RAM until then
+		*/
+		if (!downloaded && image_ctx.offset && s->staging_dir)
+			goto abort_download;
+	}
+
+	report_add(&report.download, download_start);
+	report.download_bytes = uclient_stats.received - received;
+
+	if (!downloaded)
+		goto fail_after_download;
+
+	report.result = "test_failed";
+
+	/* Test the image upgrade (issue #193) */
+	{
+		static const char *const exec_builtin = "exec ";
+		static const char *const test_option = " --test ";
+		static const char *const compat_option = " --ignore-minor-compat-version ";
+
+		char buf[strlen(exec_builtin) + strlen(sysupgrade_path) + strlen(test_option) + strlen(compat_option) + strlen(firmware_path) + 1];
+		strcpy(buf, exec_builtin);
+		strcat(buf, sysupgrade_path);
+		strcat(buf, test_option);
+		strcat(buf, compat_option);
+		strcat(buf, firmware_path);
+
+		int64_t test_start = get_monotonic_time_us();
+		const int sysupgrade_ret = system(buf);
+		report_add(&report.test, test_start);
+
+		if (WEXITSTATUS(sysupgrade_ret) != 0 ) {
+			fprintf(stderr, "autoupdater: warning: sysupgrade --test failed with return code: %d\n", WEXITSTATUS(sysupgrade_ret));
+			goto fail_after_download;
+		}
+	}
+
+	if (firmware_verified_path) {
+		if (write_file(firmware_verified_path, (const char *)m->image_hash, ECDSA_SHA256_HASH_SIZE))
+			image_share(s, m);
+		else
+			fprintf(stderr, "autoupdater: warning: failed to write %s\n", firmware_verified_path);
+	}
+
+	if (s->download_only) {
+		printf("autoupdater: info: The new firmware has been downloaded to %s and will be flashed by a later run.\n", firmware_path);
+		report.result = "staged";
+		ret = true;
+		goto out;
+	}
+
+	/* The manifest is cleared before the upgrade, the hash is needed to verify the staged image */
+	unsigned char image_hash[ECDSA_SHA256_HASH_SIZE];
+	memcpy(image_hash, m->image_hash, ECDSA_SHA256_HASH_SIZE);
+
+	clear_manifest(m);
+
+	report.result = "upgrade_failed";
+
+	/**** Call sysupgrade ************************************************/
+	if (s->no_action) {
+		printf(
+			"autoupdater: info: Aborting successful upgrade because simulation was requested.\n"
+			"autoupdater: info: You can find the firmware file in %s\n",
+			firmware_path
+		);
+		run_hooks(s, abort_d_dir, &report.abort_hooks);
+		report.result = "simulated";
+		ret = true;
+		goto out;
+	}
+
+	/* Begin upgrade */
+	run_hooks(s, upgrade_d_dir, &report.upgrade_hooks);
+
+	/* The upgrade.d scripts stop services, so there is enough free RAM now */
+	if (s->staging_dir && !copy_staged_image(image_hash, s->chunk_size))
+		goto fail_after_download;
+
+	if (s->delta_base)
+		store_delta_base(s->delta_base, s->chunk_size);
+
+	report.result = "upgrading";
+	report_write(s);
+	report.result = "upgrade_failed";
+
+	/* Unset FD_CLOEXEC so the lockfile stays locked during sysupgrade */
+	fcntl(lock_fd, F_SETFD, 0);
+
+	execl(sysupgrade_path, sysupgrade_path, "--ignore-minor-compat-version", tmp_firmware_path, NULL);
+
+	/* execl() shouldn't return */
+	fputs("autoupdater: error: failed to call sysupgrade\n", stderr);
+
+	fcntl(lock_fd, F_SETFD, FD_CLOEXEC);
+
+fail_after_download:
+	unlink(firmware_path);
+	unlink(firmware_state_path);
+	unlink(tmp_firmware_path);
+	if (firmware_verified_path) {
+		image_unshare(s);
+		unlink(firmware_verified_path);
+	}
+
+abort_download:
+	if (!s->download_only)
+		run_hooks(s, abort_d_dir, &report.abort_hooks);
+
+out:
+	clear_manifest(m);
+
+	if (interrupted)
+		report.result = "interrupted";
+	report_write(s);
+	free(report.version);
+	for (size_t i = 0; i < report.n_hooks; i++)
+		free(report.hooks[i].path);
+	free(report.hooks);
+
+	/* If we were interrupted by a signal, restore original signal handlers
+	 * and re-raise signal to terminate process */
+	if (interrupted) {
+		uloop_done();
+		raise(interrupted);
+	}
+
+	return ret;
+}
+
+
+static int lock_autoupdater(void) {
+	int fd = open(lockfile, O_CREAT|O_RDONLY|O_CLOEXEC, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "autoupdater: error: unable to open lock file: %m\n");
+		return -1;
+	}
+
+	if (flock(fd, LOCK_EX|LOCK_NB)) {
+		fputs("autoupdater: error: another instance is currently running\n", stderr);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+int main(int argc, char *argv[]) {
+	struct settings s = { };
+	parse_args(argc, argv, &s);
+
+	if (!platforminfo_get_image_name()) {
+		fputs("autoupdater: error: unsupported hardware model\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	bool external_mirrors = s.n_mirrors > 0;
+	load_settings(&s);
+	randomize();
+
+	if (s.staging_dir) {
+		char *image = safe_malloc(strlen(s.staging_dir) + strlen("/firmware.bin") + 1);
+		sprintf(image, "%s/firmware.bin", s.staging_dir);
+		char *state = safe_malloc(strlen(s.staging_dir) + strlen("/firmware.state") + 1);
+		sprintf(state, "%s/firmware.state", s.staging_dir);
+		char *verified = safe_malloc(strlen(s.staging_dir) + strlen("/firmware.verified") + 1);
+		sprintf(verified, "%s/firmware.verified", s.staging_dir);
+
+		firmware_path = image;
+		firmware_state_path = state;
+		firmware_verified_path = verified;
+	}
+	else if (s.download_only) {
+		fputs("autoupdater: error: --download-only requires a staging directory (option 'staging_dir')\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	int lock_fd = lock_autoupdater();
+	if (lock_fd < 0)
+		return EXIT_FAILURE;
+
+	uloop_init();
+
+	/* Shuffle the configured mirrors, so mirrors with equal latency are used evenly */
+	if (!external_mirrors) {
+		for (size_t i = s.n_mirrors; i > 1; i--) {
+			size_t j = random() % i;
+			const char *tmp = s.mirrors[i-1];
+			s.mirrors[i-1] = s.mirrors[j];
+			s.mirrors[j] = tmp;
+		}
+	}
+
+	if (s.n_mirrors && autoupdate(&s, lock_fd)) {
+		// update the mtime of the lockfile to indicate a successful run
+		futimens(lock_fd, NULL);
 
-		/* When the update has failed, remove the mirror from the list */
-		*mirror = NULL;
-		mirrors_left--;
+		return EXIT_SUCCESS;
 	}
 
 	uloop_done();
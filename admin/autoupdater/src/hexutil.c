@@ -19,3 +19,13 @@ bool parsehex(void *output, const char *input, size_t len) {
 
 	return true;
 }
+
+
+void formathex(char *output, const void *input, size_t len) {
+	const unsigned char *buffer = input;
+
+	for (size_t i = 0; i < len; i++)
+		sprintf(&output[2*i], "%02x", buffer[i]);
+
+	output[2*len] = 0;
+}
@@ -11,3 +11,8 @@
  * must fit exactly into the buffer.
  */
 bool parsehex(void *buffer, const char *string, size_t len);
+
+/* Stores the hexadecimal representation of len bytes of a buffer as string;
+ * the string must have room for 2 * len + 1 characters.
+ */
+void formathex(char *string, const void *buffer, size_t len);
@@ -17,6 +17,10 @@ void clear_manifest(struct manifest *m) {
 	free(m->image_filename);
 	free(m->version);
 
+	for (size_t i = 0; i < m->n_deltas; i++)
+		free(m->deltas[i].filename);
+	free(m->deltas);
+
 	for (size_t i = 0; i < m->n_signatures; i++)
 		free(m->signatures[i]);
 	free(m->signatures);
@@ -56,77 +60,197 @@ static bool parse_rfc3339(const char *input, time_t *date) {
 }
 
 
-void parse_line(char *line, struct manifest *m, const char *branch, const char *image_name) {
+static bool parse_size(const char *input, ssize_t *size) {
+	char *endptr;
+
+	errno = 0;
+	unsigned long long val = strtoull(input, &endptr, 10);
+	if (errno || *endptr || val > SSIZE_MAX)
+		return false;
+
+	*size = val;
+	return true;
+}
+
+
+/*
+ * Delta lines have the format
+ *   DELTA <model> <base image sha256sum> <delta sha256sum> <delta size> <filename>
+ * Older autoupdaters ignore them, as they have more fields than image lines.
+ */
+static void parse_delta(char *line, struct manifest *m, const char *image_name) {
+	struct manifest_delta delta = {};
+
+	char *model = strtok(line, " ");
+	char *base_checksum = strtok(NULL, " ");
+	char *checksum = strtok(NULL, " ");
+	char *size = strtok(NULL, " ");
+	char *filename = strtok(NULL, " ");
+	if (!filename || strtok(NULL, " "))
+		return;
+
+	if (strcmp(model, image_name) != 0)
+		return;
+
+	if (!parsehex(delta.base_hash, base_checksum, ECDSA_SHA256_HASH_SIZE))
+		return;
+	if (!parsehex(delta.hash, checksum, ECDSA_SHA256_HASH_SIZE))
+		return;
+	if (!parse_size(size, &delta.size))
+		return;
+
+	delta.filename = strdup(filename);
+
+	m->n_deltas++;
+	m->deltas = safe_realloc(m->deltas, m->n_deltas * sizeof(*m->deltas));
+	m->deltas[m->n_deltas - 1] = delta;
+}
+
+
+static void parse_image(char *line, struct manifest *m, const char *image_name) {
+	char *model = strtok(line, " ");
+	char *version = strtok(NULL, " ");
+	char *checksum = strtok(NULL, " ");
+	char *imagesize = strtok(NULL, " ");
+	char *filename = strtok(NULL, " ");
+	if (!filename || strtok(NULL, " "))
+		return;
+
+	if (strcmp(model, image_name) != 0)
+		return;
+
+	if (!parsehex(m->image_hash, checksum, ECDSA_SHA256_HASH_SIZE))
+		return;
+
+	if (!parse_size(imagesize, &m->imagesize))
+		return;
+
+	m->version = strdup(version);
+	m->image_filename = strdup(filename);
+
+	m->model_ok = true;
+}
+
+
+static void parse_signature(const char *line, size_t len, struct manifest *m) {
+	char *str = strndup(line, len);
+	ecdsa_signature_t *sig = safe_malloc(sizeof(ecdsa_signature_t));
+
+	if (!parsehex(sig, str, sizeof(*sig))) {
+		free(sig);
+		fprintf(stderr, "autoupdater: warning: garbage in signature area: %s\n", str);
+		free(str);
+		return;
+	}
+	free(str);
+
+	m->n_signatures++;
+	m->signatures = safe_realloc(m->signatures, m->n_signatures * sizeof(ecdsa_signature_t *));
+	m->signatures[m->n_signatures - 1] = sig;
+}
+
+
+static bool has_prefix(const char *line, size_t len, const char *prefix) {
+	size_t prefix_len = strlen(prefix);
+	return len >= prefix_len && !memcmp(line, prefix, prefix_len);
+}
+
+
+/*
+ * Checks if the first field of a line is the image name; this rejects
+ * the lines of other models without splitting them into fields
+ */
+static bool matches_model(const struct manifest_parser *p, const char *line, size_t len) {
+	while (len && *line == ' ') {
+		line++;
+		len--;
+	}
+
+	return len > p->image_name_len && line[p->image_name_len] == ' ' &&
+		!memcmp(line, p->image_name, p->image_name_len);
+}
+
+
+static void parse_line(const struct manifest_parser *p, struct manifest *m, const char *line, size_t len) {
 	if (m->sep_found) {
-		ecdsa_signature_t *sig = safe_malloc(sizeof(ecdsa_signature_t));
+		parse_signature(line, len, m);
+		return;
+	}
 
-		if (!parsehex(sig, line, sizeof(*sig))) {
-			free(sig);
-			fprintf(stderr, "autoupdater: warning: garbage in signature area: %s\n", line);
-			return;
-		}
-		m->n_signatures++;
-		m->signatures = safe_realloc(m->signatures, m->n_signatures * sizeof(ecdsa_signature_t *));
-		m->signatures[m->n_signatures - 1] = sig;
-	} else if (strcmp(line, "---") == 0) {
+	if (len == 3 && !memcmp(line, "---", 3)) {
 		m->sep_found = true;
-	} else {
-		ecdsa_sha256_update(&m->hash_ctx, line, strlen(line));
-		ecdsa_sha256_update(&m->hash_ctx, "\n", 1);
+		return;
+	}
 
-		if (!strncmp(line, "BRANCH=", 7) && !strcmp(&line[7], branch)) {
-			m->branch_ok = true;
-		}
+	ecdsa_sha256_update(&m->hash_ctx, line, len);
+	ecdsa_sha256_update(&m->hash_ctx, "\n", 1);
 
-		else if (!strncmp(line, "DATE=", 5)) {
-			if (m->date_ok)
-				return;
+	if (has_prefix(line, len, "BRANCH=")) {
+		if (len - 7 == p->branch_len && !memcmp(&line[7], p->branch, p->branch_len))
+			m->branch_ok = true;
+	}
 
-			m->date_ok = parse_rfc3339(&line[5], &m->date);
-		}
+	else if (has_prefix(line, len, "DATE=")) {
+		if (m->date_ok)
+			return;
 
-		else if (!strncmp(line, "PRIORITY=", 9)) {
-			if (m->priority_ok)
-				return;
+		char *date = strndup(&line[5], len - 5);
+		m->date_ok = parse_rfc3339(date, &m->date);
+		free(date);
+	}
 
-			m->priority = strtof(&line[9], NULL);
-			m->priority_ok = true;
-		}
+	else if (has_prefix(line, len, "PRIORITY=")) {
+		if (m->priority_ok)
+			return;
 
-		else {
-			if (m->model_ok)
-				return;
+		char *priority = strndup(&line[9], len - 9);
+		m->priority = strtof(priority, NULL);
+		m->priority_ok = true;
+		free(priority);
+	}
 
-			char *model = strtok(line, " ");
-			char *version = strtok(NULL, " ");
-			char *checksum = strtok(NULL, " ");
-			char *imagesize = strtok(NULL, " ");
-			char *filename = strtok(NULL, " ");
-			if (!filename || strtok(NULL, " "))
-				return;
+	else if (has_prefix(line, len, "DELTA ")) {
+		if (!matches_model(p, &line[6], len - 6))
+			return;
 
-			if (strcmp(model, image_name) != 0)
-				return;
+		char *delta = strndup(&line[6], len - 6);
+		parse_delta(delta, m, p->image_name);
+		free(delta);
+	}
 
-			if (!parsehex(m->image_hash, checksum, ECDSA_SHA256_HASH_SIZE))
-				return;
+	else {
+		if (m->model_ok || !matches_model(p, line, len))
+			return;
 
-			{
+		char *image = strndup(line, len);
+		parse_image(image, m, p->image_name);
+		free(image);
+	}
+}
 
-				char *endptr;
 
-				errno = 0;
-				unsigned long long val = strtoull(imagesize, &endptr, 10);
-				if (errno || *endptr || val > SSIZE_MAX)
-					return;
+void manifest_parser_init(struct manifest_parser *p, const char *branch, const char *image_name) {
+	*p = (struct manifest_parser){
+		.branch = branch,
+		.branch_len = strlen(branch),
+		.image_name = image_name,
+		.image_name_len = strlen(image_name),
+	};
+}
 
-				m->imagesize = val;
-			}
 
-			m->version = strdup(version);
-			m->image_filename = strdup(filename);
+/*
+ * Parses all complete lines of a (partially received) manifest, and
+ * returns the number of bytes parsed. The remaining incomplete line must
+ * be passed again when more data has been received.
+ */
+size_t parse_manifest(const struct manifest_parser *p, struct manifest *m, const char *data, size_t len) {
+	const char *line = data, *end = data + len, *newline;
 
-			m->model_ok = true;
-		}
+	while ((newline = memchr(line, '\n', end - line))) {
+		parse_line(p, m, line, newline - line);
+		line = newline + 1;
 	}
+
+	return line - data;
 }
@@ -11,6 +11,14 @@
 #include <time.h>
 
 
+/** A binary delta from a base image to the image of the manifest */
+struct manifest_delta {
+	unsigned char base_hash[ECDSA_SHA256_HASH_SIZE];
+	unsigned char hash[ECDSA_SHA256_HASH_SIZE];
+	ssize_t size;
+	char *filename;
+};
+
 struct manifest {
 	bool sep_found:1;
 	bool branch_ok:1;
@@ -24,12 +32,25 @@ struct manifest {
 	float priority;
 	ssize_t imagesize;
 
+	size_t n_deltas;
+	struct manifest_delta *deltas;
+
 	size_t n_signatures;
 	ecdsa_signature_t **signatures;
 	ecdsa_sha256_context_t hash_ctx;
 };
 
 
+/** The branch and image name manifest lines are matched against */
+struct manifest_parser {
+	const char *branch;
+	size_t branch_len;
+	const char *image_name;
+	size_t image_name_len;
+};
+
+
 void clear_manifest(struct manifest *m);
 
-void parse_line(char *line, struct manifest *m, const char *branch, const char *image_name);
+void manifest_parser_init(struct manifest_parser *p, const char *branch, const char *image_name);
+size_t parse_manifest(const struct manifest_parser *p, struct manifest *m, const char *data, size_t len);
@@ -9,10 +9,17 @@
 
 #include <uci.h>
 
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
 
+/* Default size of the chunks the image is written and hashed in */
+#define DEFAULT_CHUNK_SIZE (64*1024)
+#define MIN_CHUNK_SIZE 1024
+#define MAX_CHUNK_SIZE (16*1024*1024)
+
+
 static char * read_one_line(const char *filename) {
 	FILE *f = fopen(filename, "r");
 	if (!f)
@@ -115,6 +122,54 @@ void load_settings(struct settings *settings) {
 		exit(0);
 	}
 
+	const char *segmented = uci_lookup_option_string(ctx, s, "segmented");
+	if (segmented && !strcmp(segmented, "1"))
+		settings->segmented = true;
+
+	const char *sharded_manifest = uci_lookup_option_string(ctx, s, "sharded_manifest");
+	if (sharded_manifest && !strcmp(sharded_manifest, "1"))
+		settings->sharded_manifest = true;
+
+	const char *mmap = uci_lookup_option_string(ctx, s, "mmap");
+	if (mmap && !strcmp(mmap, "1"))
+		settings->mmap = true;
+
+	settings->chunk_size = DEFAULT_CHUNK_SIZE;
+	const char *chunk_size = uci_lookup_option_string(ctx, s, "chunk_size");
+	if (chunk_size) {
+		char *end;
+		unsigned long val = strtoul(chunk_size, &end, 0);
+		if (*end || val < MIN_CHUNK_SIZE || val > MAX_CHUNK_SIZE) {
+			fputs("autoupdater: error: invalid value for option 'chunk_size'\n", stderr);
+			exit(1);
+		}
+
+		settings->chunk_size = val;
+	}
+
+	settings->staging_dir = uci_lookup_option_string(ctx, s, "staging_dir");
+	settings->delta_base = uci_lookup_option_string(ctx, s, "delta_base");
+	settings->share_dir = uci_lookup_option_string(ctx, s, "share_dir");
+	settings->peer_command = uci_lookup_option_string(ctx, s, "peer_command");
+	if (uci_lookup_option(ctx, s, "peer"))
+		settings->peers = load_string_list(ctx, s, "peer", &settings->n_peers);
+
+	const char *parallel_hooks = uci_lookup_option_string(ctx, s, "parallel_hooks");
+	if (parallel_hooks && !strcmp(parallel_hooks, "1"))
+		settings->parallel_hooks = true;
+
+	const char *hook_timeout = uci_lookup_option_string(ctx, s, "hook_timeout");
+	if (hook_timeout) {
+		char *end;
+		unsigned long val = strtoul(hook_timeout, &end, 10);
+		if (*end || val > UINT_MAX) {
+			fputs("autoupdater: error: invalid value for option 'hook_timeout'\n", stderr);
+			exit(1);
+		}
+
+		settings->hook_timeout = val;
+	}
+
 	const char *version_file = uci_lookup_option_string(ctx, s, "version_file");
 	if (version_file)
 		settings->old_version = read_one_line(version_file);
@@ -12,6 +12,17 @@ struct settings {
 	bool fallback;
 	bool no_action;
 	bool force_version;
+	bool download_only;
+	bool segmented;
+	bool sharded_manifest;
+	bool mmap;
+	size_t chunk_size;
+	const char *staging_dir;
+	const char *delta_base;
+	const char *share_dir;
+	const char *peer_command;
+	bool parallel_hooks;
+	unsigned hook_timeout;
 	const char *branch;
 	unsigned long good_signatures;
 	char *old_version;
@@ -19,6 +30,9 @@ struct settings {
 	size_t n_mirrors;
 	const char **mirrors;
 
+	size_t n_peers;
+	const char **peers;
+
 	size_t n_pubkeys;
 	ecc_25519_work_t *pubkeys;
 };
@@ -3,23 +3,34 @@
 
 
 #include "uclient.h"
+#include "util.h"
 
 #include <libubox/blobmsg.h>
 #include <libubox/uloop.h>
 
+#include <inttypes.h>
 #include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 
 #define TIMEOUT_MSEC 300000
 
+/** Timeout for establishing a connection (DNS lookup excluded) */
+#define CONNECT_TIMEOUT_MSEC 10000
+
 static const char *const user_agent = "Gluon Autoupdater (using libuclient)";
 
+/* Inactivity timeout of new requests */
+static unsigned timeout_msec = TIMEOUT_MSEC;
+
 enum uclient_own_error_code {
 	UCLIENT_ERROR_REDIRECT_FAILED = 32,
 	UCLIENT_ERROR_TOO_MANY_REDIRECTS,
 	UCLIENT_ERROR_CONNECTION_RESET_PREMATURELY,
 	UCLIENT_ERROR_SIZE_MISMATCH,
+	UCLIENT_ERROR_RANGE_MISMATCH,
 	UCLIENT_ERROR_STATUS_CODE = 1024,
 	UCLIENT_ERROR_INTERRUPTED = 2048,
 };
@@ -51,6 +62,8 @@ const char *uclient_get_errmsg(int code) {
 		return "Connection reset prematurely";
 	case UCLIENT_ERROR_SIZE_MISMATCH:
 		return "Incorrect file size";
+	case UCLIENT_ERROR_RANGE_MISMATCH:
+		return "Incorrect content range";
 	default:
 		return "Unknown error";
 	}
@@ -63,19 +76,96 @@ int uclient_interrupted_signal(int code) {
 	return 0;
 }
 
+int uclient_status_code(int code) {
+	if (code & UCLIENT_ERROR_STATUS_CODE)
+		return code & (~UCLIENT_ERROR_STATUS_CODE);
+
+	return 0;
+}
+
+
+/** Per-request state of get_url_async() */
+struct uclient_request {
+	struct uclient_data data;
+	struct uclient_cb cb;
+};
+
+
+struct uclient_stats uclient_stats;
 
+
+/**
+	Records the result of a request
+
+	Only the first result of a request counts. Synchronous requests end the
+	uloop, asynchronous requests call their done callback instead.
+*/
 static void request_done(struct uclient *cl, int err_code) {
-	uclient_data(cl)->err_code = err_code;
-	uloop_end();
+	struct uclient_data *d = uclient_data(cl);
+	if (d->done)
+		return;
+
+	if (!err_code && d->length >= 0 && d->downloaded != d->length)
+		err_code = UCLIENT_ERROR_SIZE_MISMATCH;
+
+	d->err_code = err_code;
+	d->done = true;
+
+	if (d->done_cb)
+		d->done_cb(cl);
+	else
+		uloop_end();
+}
+
+
+/** Checks that a partial response starts at the requested offset */
+static bool check_content_range(struct uclient *cl, struct blob_attr *tb_range) {
+	struct uclient_data *d = uclient_data(cl);
+	unsigned long long start, end;
+
+	if (!tb_range)
+		return false;
+
+	if (sscanf(blobmsg_get_string(tb_range), "bytes %llu-%llu/", &start, &end) != 2)
+		return false;
+
+	if (start != (unsigned long long)d->offset || end < start)
+		return false;
+
+	return d->length < 0 || end - start + 1 == (unsigned long long)d->length;
 }
 
 
 static void header_done_cb(struct uclient *cl) {
-	const struct blobmsg_policy policy = {
-		.name = "content-length",
-		.type = BLOBMSG_TYPE_STRING,
+	enum {
+		HEADER_CONTENT_LENGTH,
+		HEADER_CONTENT_RANGE,
+		HEADER_ETAG,
+		HEADER_LAST_MODIFIED,
+		__HEADER_MAX,
+	};
+	const struct blobmsg_policy policy[__HEADER_MAX] = {
+		[HEADER_CONTENT_LENGTH] = {
+			.name = "content-length",
+			.type = BLOBMSG_TYPE_STRING,
+		},
+		[HEADER_CONTENT_RANGE] = {
+			.name = "content-range",
+			.type = BLOBMSG_TYPE_STRING,
+		},
+		[HEADER_ETAG] = {
+			.name = "etag",
+			.type = BLOBMSG_TYPE_STRING,
+		},
+		[HEADER_LAST_MODIFIED] = {
+			.name = "last-modified",
+			.type = BLOBMSG_TYPE_STRING,
+		},
 	};
-	struct blob_attr *tb_len;
+	struct blob_attr *tb[__HEADER_MAX];
+	struct uclient_data *d = uclient_data(cl);
+
+	uclient_data(cl)->header_time = get_monotonic_time();
 
 	if (uclient_data(cl)->retries < 10) {
 		int ret = uclient_http_redirect(cl);
@@ -89,9 +179,38 @@ static void header_done_cb(struct uclient *cl) {
 		}
 	}
 
+	blobmsg_parse(policy, __HEADER_MAX, tb, blob_data(cl->meta), blob_len(cl->meta));
+
+	if (tb[HEADER_ETAG])
+		d->validators.etag = strdup(blobmsg_get_string(tb[HEADER_ETAG]));
+	if (tb[HEADER_LAST_MODIFIED])
+		d->validators.last_modified = strdup(blobmsg_get_string(tb[HEADER_LAST_MODIFIED]));
+
 	switch (cl->status_code) {
 	case 200:
+		/* The server has ignored the Range header and sends the whole file */
+		if (d->range_only) {
+			request_done(cl, UCLIENT_ERROR_RANGE_MISMATCH);
+			return;
+		}
+
+		if (d->offset) {
+			if (d->length >= 0)
+				d->length += d->offset;
+			d->offset = 0;
+		}
 		break;
+	case 206:
+		if (!check_content_range(cl, tb[HEADER_CONTENT_RANGE])) {
+			request_done(cl, UCLIENT_ERROR_RANGE_MISMATCH);
+			return;
+		}
+		break;
+	case 304:
+		d->not_modified = true;
+		d->length = -1;
+		request_done(cl, 0);
+		return;
 	case 301:
 	case 302:
 	case 307:
@@ -102,19 +221,18 @@ static void header_done_cb(struct uclient *cl) {
 		return;
 	}
 
-	blobmsg_parse(&policy, 1, &tb_len, blob_data(cl->meta), blob_len(cl->meta));
-	if (tb_len) {
+	if (tb[HEADER_CONTENT_LENGTH]) {
 		char *endptr;
 
 		errno = 0;
-		unsigned long long val = strtoull(blobmsg_get_string(tb_len), &endptr, 10);
+		unsigned long long val = strtoull(blobmsg_get_string(tb[HEADER_CONTENT_LENGTH]), &endptr, 10);
 		if (!errno && !*endptr && val <= SSIZE_MAX) {
-			if (uclient_data(cl)->length >= 0 && uclient_data(cl)->length != (ssize_t)val) {
+			if (d->length >= 0 && d->length != (ssize_t)val) {
 				request_done(cl, UCLIENT_ERROR_SIZE_MISMATCH);
 				return;
 			}
 
-			uclient_data(cl)->length = val;
+			d->length = val;
 		}
 	}
 }
@@ -131,6 +249,7 @@ ssize_t uclient_read_account(struct uclient *cl, char *buf, int len) {
 
 	if (r >= 0) {
 		d->downloaded += r;
+		uclient_stats.received += r;
 
 		if (d->length >= 0 && d->downloaded > d->length) {
 			request_done(cl, UCLIENT_ERROR_SIZE_MISMATCH);
@@ -142,25 +261,70 @@ ssize_t uclient_read_account(struct uclient *cl, char *buf, int len) {
 }
 
 
-int get_url(const char *url, void (*read_cb)(struct uclient *cl), void *cb_data, ssize_t len, const char *firmware_version) {
-	struct uclient_data d = { .custom = cb_data, .length = len };
-	struct uclient_cb cb = {
-		.header_done = header_done_cb,
-		.data_read = read_cb,
-		.data_eof = eof_cb,
-		.error = request_done,
+/**
+	Starts a request without waiting for it to finish
+
+	If offset is non-zero or len is given, only the len bytes starting at
+	offset (or the rest of the file if len is negative) are requested.
+	Servers may ignore this and send the whole file, which is indicated by
+	an offset of 0 in uclient_data(cl) when the data arrives, unless
+	range_only is set, which makes the request fail instead.
+
+	If cached is given, the request is conditional on the file having
+	changed since the response the validators belong to. If it hasn't, the
+	request finishes without data and not_modified is set in uclient_data(cl).
+
+	done_cb is called from the uloop when the request has finished; the
+	result can be found in uclient_data(cl)->err_code. The request must be
+	freed with get_url_free(), but not from within one of its callbacks.
+*/
+struct uclient * get_url_async(const char *url, void (*read_cb)(struct uclient *cl), void (*done_cb)(struct uclient *cl), void *cb_data, ssize_t offset, ssize_t len, const struct uclient_validators *cached, const char *firmware_version) {
+	struct uclient_request *req = safe_malloc(sizeof(*req));
+	*req = (struct uclient_request){
+		.data = {
+			.custom = cb_data,
+			.done_cb = done_cb,
+			.offset = offset,
+			.length = len,
+			.start_time = get_monotonic_time(),
+		},
+		.cb = {
+			.header_done = header_done_cb,
+			.data_read = read_cb,
+			.data_eof = eof_cb,
+			.error = request_done,
+		},
 	};
-	int ret = UCLIENT_ERROR_CONNECT;
 
-	struct uclient *cl = uclient_new(url, NULL, &cb);
-	if (!cl)
-		goto err;
+	struct uclient *cl = uclient_new(url, NULL, &req->cb);
+	if (!cl) {
+		free(req);
+		return NULL;
+	}
 
-	cl->priv = &d;
-	if (uclient_set_timeout(cl, TIMEOUT_MSEC))
+	cl->priv = &req->data;
+
+	/*
+		uclient_connect() blocks until the TCP connection is established,
+		so an unreachable server must not stall the other requests for
+		the whole inactivity timeout
+	*/
+	if (uclient_set_timeout(cl, timeout_msec < CONNECT_TIMEOUT_MSEC ? timeout_msec : CONNECT_TIMEOUT_MSEC))
 		goto err;
+
+	int64_t connect_start = get_monotonic_time_us();
 	if (uclient_connect(cl))
 		goto err;
+
+	int64_t connect_time = get_monotonic_time_us() - connect_start;
+	printf("Connected to %s in %"PRId64" ms\n", cl->url->host, connect_time / 1000);
+
+	uclient_stats.connections++;
+	uclient_stats.connect_time += connect_time;
+
+	if (uclient_set_timeout(cl, timeout_msec))
+		goto err;
+
 	if (uclient_http_set_request_type(cl, "GET"))
 		goto err;
 	if (uclient_http_reset_headers(cl))
@@ -171,28 +335,66 @@ int get_url(const char *url, void (*read_cb)(struct uclient *cl), void *cb_data,
 		if (uclient_http_set_header(cl, "X-Firmware-Version", firmware_version))
 			goto err;
 	}
+	if (cached && cached->etag) {
+		if (uclient_http_set_header(cl, "If-None-Match", cached->etag))
+			goto err;
+	}
+	if (cached && cached->last_modified) {
+		if (uclient_http_set_header(cl, "If-Modified-Since", cached->last_modified))
+			goto err;
+	}
+	if (offset || len > 0) {
+		char range[48];
+		if (len > 0)
+			snprintf(range, sizeof(range), "bytes=%zd-%zd", offset, offset + len - 1);
+		else
+			snprintf(range, sizeof(range), "bytes=%zd-", offset);
+		if (uclient_http_set_header(cl, "Range", range))
+			goto err;
+	}
 	if (uclient_request(cl))
 		goto err;
 
-	ret = uloop_run();
+	return cl;
+
+err:
+	get_url_free(cl);
+	return NULL;
+}
+
+
+/** Aborts a request if it is still running, and frees it */
+void get_url_free(struct uclient *cl) {
+	struct uclient_request *req = container_of(uclient_data(cl), struct uclient_request, data);
+
+	uclient_disconnect(cl);
+	uclient_free(cl);
+	free(req->data.validators.etag);
+	free(req->data.validators.last_modified);
+	free(req);
+}
+
+
+/** Sets the inactivity timeout of the following requests; 0 restores the default */
+void get_url_set_timeout(unsigned msec) {
+	timeout_msec = msec ?: TIMEOUT_MSEC;
+}
+
+
+int get_url(const char *url, void (*read_cb)(struct uclient *cl), void *cb_data, ssize_t offset, ssize_t len, const char *firmware_version) {
+	struct uclient *cl = get_url_async(url, read_cb, NULL, cb_data, offset, len, NULL, firmware_version);
+	if (!cl)
+		return UCLIENT_ERROR_CONNECT;
+
+	int ret = uloop_run();
 	if (ret) {
 		/* uloop_run() returns a signal number when interrupted */
 		ret |= UCLIENT_ERROR_INTERRUPTED;
-		goto err;
 	}
-
-	if (!d.err_code && d.length >= 0 && d.downloaded != d.length) {
-		ret = UCLIENT_ERROR_SIZE_MISMATCH;
-		goto err;
-	}
-
-	ret = d.err_code;
-
-err:
-	if (cl) {
-		uclient_disconnect(cl);
-		uclient_free(cl);
+	else {
+		ret = uclient_data(cl)->err_code;
 	}
 
+	get_url_free(cl);
 	return ret;
 }
@@ -4,19 +4,52 @@
 
 
 #include <libubox/uclient.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 
+/** Validators of a response, used to make conditional requests for cached files */
+struct uclient_validators {
+	char *etag;
+	char *last_modified;
+};
+
 struct uclient_data {
 	/* data that can be passed in by caller and used in custom callbacks */
 	void *custom;
+	/* called when an asynchronous request has finished */
+	void (*done_cb)(struct uclient *cl);
 	/* data used by uclient callbacks */
 	int retries;
 	int err_code;
+	bool done;
+	/* position of the first byte of the response in the requested file */
+	ssize_t offset;
+	/* fail instead of accepting the whole file when the Range header is ignored */
+	bool range_only;
 	ssize_t downloaded;
 	ssize_t length;
+	/* times the request was started and the response header was received (in ms) */
+	int64_t start_time;
+	int64_t header_time;
+	/* the file hasn't changed since the response the conditional request was made for */
+	bool not_modified;
+	/* validators of the response (fields are NULL if not sent by the server) */
+	struct uclient_validators validators;
 };
 
+/** Statistics over all requests */
+struct uclient_stats {
+	unsigned connections;
+	/* time spent establishing connections (DNS lookup and TCP handshake, in us) */
+	int64_t connect_time;
+	/* number of bytes received */
+	int64_t received;
+};
+
+extern struct uclient_stats uclient_stats;
+
 inline struct uclient_data * uclient_data(struct uclient *cl) {
 	return (struct uclient_data *)cl->priv;
 }
@@ -28,6 +61,10 @@ inline void * uclient_get_custom(struct uclient *cl) {
 
 ssize_t uclient_read_account(struct uclient *cl, char *buf, int len);
 
-int get_url(const char *url, void (*read_cb)(struct uclient *cl), void *cb_data, ssize_t len, const char *firmware_version);
+int get_url(const char *url, void (*read_cb)(struct uclient *cl), void *cb_data, ssize_t offset, ssize_t len, const char *firmware_version);
+struct uclient * get_url_async(const char *url, void (*read_cb)(struct uclient *cl), void (*done_cb)(struct uclient *cl), void *cb_data, ssize_t offset, ssize_t len, const struct uclient_validators *cached, const char *firmware_version);
+void get_url_free(struct uclient *cl);
+void get_url_set_timeout(unsigned msec);
 const char *uclient_get_errmsg(int code);
 int uclient_interrupted_signal(int code);
+int uclient_status_code(int code);
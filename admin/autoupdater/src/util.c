@@ -4,8 +4,11 @@
 
 #include "util.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <glob.h>
+#include <inttypes.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,40 +18,219 @@
 #include <sys/wait.h>
 
 
-void run_dir(const char *dir) {
+/* Interval in which running hooks are checked (in ms) */
+#define HOOK_POLL_INTERVAL 20
+/* Time between SIGTERM and SIGKILL for hooks that have exceeded the timeout (in seconds) */
+#define HOOK_KILL_GRACE 5
+
+
+/** A running hook script */
+struct hook {
+	const char *path;
+	pid_t pid;
+	int64_t start;
+	bool done;
+	bool timed_out;
+};
+
+
+/** Returns the length of the leading number of a hook's filename, which determines its group */
+static size_t hook_group_len(const char *path) {
+	const char *name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+
+	return (name - path) + strspn(name, "0123456789");
+}
+
+
+static bool same_group(const char *a, const char *b) {
+	size_t len = hook_group_len(a);
+
+	/* Hooks without a number always run on their own */
+	if (len == (size_t)(strrchr(a, '/') + 1 - a))
+		return false;
+
+	return len == hook_group_len(b) && !strncmp(a, b, len);
+}
+
+
+static void hook_start(struct hook *hook) {
+	hook->start = get_monotonic_time_us();
+
+	hook->pid = fork();
+	if (hook->pid < 0) {
+		fprintf(stderr, "autoupdater: warning: failed to fork: %m\n");
+		hook->done = true;
+		return;
+	}
+
+	if (hook->pid == 0) {
+		/* Own process group, so the hook can be killed together with its children */
+		setpgid(0, 0);
+		execl(hook->path, hook->path, (char *)NULL);
+		exit(EXIT_FAILURE);
+	}
+
+	setpgid(hook->pid, hook->pid);
+}
+
+
+static void hook_finish(struct hook *hook, int wstatus, const struct hook_options *opts) {
+	int64_t duration = get_monotonic_time_us() - hook->start;
+
+	hook->done = true;
+
+	if (hook->timed_out) {
+		fprintf(stderr, "autoupdater: warning: execution of %s was killed after %u seconds\n", hook->path, opts->timeout);
+	} else if (!WIFEXITED(wstatus)) {
+		fprintf(stderr, "autoupdater: warning: execution of %s exited abnormally\n", hook->path);
+	} else if (WEXITSTATUS(wstatus)) {
+		fprintf(stderr, "autoupdater: warning: execution of %s exited with status code %d\n", hook->path, WEXITSTATUS(wstatus));
+	}
+
+	printf("Hook %s finished after %"PRId64" ms\n", hook->path, duration / 1000);
+
+	if (opts->done_cb)
+		opts->done_cb(hook->path, duration, hook->timed_out, opts->arg);
+}
+
+
+/**
+	Waits for a group of hooks without a timeout
+
+	Whichever hook exits first is reaped first, so the duration of each
+	parallel hook is measured up to its own exit.
+*/
+static void hooks_wait_blocking(struct hook *hooks, size_t n_hooks, const struct hook_options *opts) {
+	size_t running = 0;
+	for (size_t i = 0; i < n_hooks; i++) {
+		if (!hooks[i].done)
+			running++;
+	}
+
+	while (running) {
+		int wstatus;
+		pid_t ret = waitpid(-1, &wstatus, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			for (size_t i = 0; i < n_hooks; i++) {
+				struct hook *hook = &hooks[i];
+				if (hook->done)
+					continue;
+
+				fprintf(stderr, "autoupdater: warning: failed waiting for child %d corresponding to %s: %m\n", hook->pid, hook->path);
+				hook->done = true;
+			}
+			return;
+		}
+
+		for (size_t i = 0; i < n_hooks; i++) {
+			struct hook *hook = &hooks[i];
+			if (hook->done || hook->pid != ret)
+				continue;
+
+			hook_finish(hook, wstatus, opts);
+			running--;
+			break;
+		}
+	}
+}
+
+
+/**
+	Waits for a group of hooks, killing hooks that exceed the timeout
+
+	Hooks are sent SIGTERM on timeout, and SIGKILL if they are still running
+	after a grace period.
+*/
+static void hooks_wait(struct hook *hooks, size_t n_hooks, const struct hook_options *opts) {
+	if (!opts->timeout) {
+		hooks_wait_blocking(hooks, n_hooks, opts);
+		return;
+	}
+
+	size_t running = 0;
+	for (size_t i = 0; i < n_hooks; i++) {
+		if (!hooks[i].done)
+			running++;
+	}
+
+	while (running) {
+		int64_t now = get_monotonic_time_us();
+
+		for (size_t i = 0; i < n_hooks; i++) {
+			struct hook *hook = &hooks[i];
+			if (hook->done)
+				continue;
+
+			int wstatus;
+			pid_t ret = waitpid(hook->pid, &wstatus, WNOHANG);
+			if (ret == hook->pid) {
+				hook_finish(hook, wstatus, opts);
+				running--;
+				continue;
+			}
+			if (ret < 0 && errno != EINTR) {
+				fprintf(stderr, "autoupdater: warning: failed waiting for child %d corresponding to %s: ", hook->pid, hook->path);
+				perror(NULL);
+				hook->done = true;
+				running--;
+				continue;
+			}
+
+			int64_t deadline = hook->start + (int64_t)opts->timeout * 1000000;
+			if (!hook->timed_out && now >= deadline) {
+				hook->timed_out = true;
+				kill(-hook->pid, SIGTERM);
+			}
+			else if (hook->timed_out && now >= deadline + HOOK_KILL_GRACE * 1000000) {
+				kill(-hook->pid, SIGKILL);
+			}
+		}
+
+		if (running)
+			usleep(HOOK_POLL_INTERVAL * 1000);
+	}
+}
+
+
+/**
+	Runs the executable files in a directory in alphabetical order
+
+	If opts->parallel is set, consecutive hooks whose filenames start with the
+	same number (e.g. "20stop-foo" and "20stop-bar") form a group that is
+	run in parallel; the next group is started when all hooks of the group
+	have finished.
+*/
+void run_dir(const char *dir, const struct hook_options *opts) {
 	char pat[strlen(dir) + 3];
 	sprintf(pat, "%s/*", dir);
 	glob_t globbuf;
 	if (glob(pat, 0, NULL, &globbuf))
 		return;
 
+	struct hook hooks[globbuf.gl_pathc];
+	size_t n_hooks = 0;
+
 	for (size_t i = 0; i < globbuf.gl_pathc; i++) {
 		char *path = globbuf.gl_pathv[i];
 		if (access(path, X_OK) < 0)
 			continue;
 
-		pid_t pid = fork();
-		if (pid < 0) {
-			fputs("autoupdater: warning: failed to fork: %m", stderr);
-			continue;
-		}
-
-		if (pid == 0) {
-			execl(path, path, (char *)NULL);
-			exit(EXIT_FAILURE);
+		if (n_hooks && !(opts->parallel && same_group(hooks[0].path, path))) {
+			hooks_wait(hooks, n_hooks, opts);
+			n_hooks = 0;
 		}
 
-		int wstatus;
-		if (waitpid(pid, &wstatus, 0) != pid) {
-			fprintf(stderr, "autoupdater: warning: failed waiting for child %d corresponding to %s: ", pid, path);
-			perror(NULL);
-		} else if (!WIFEXITED(wstatus)) {
-			fprintf(stderr, "autoupdater: warning: execution of %s exited abnormally\n", path);
-		} else if (WEXITSTATUS(wstatus)) {
-			fprintf(stderr, "autoupdater: warning: execution of %s exited with status code %d\n", path, WEXITSTATUS(wstatus));
-		}
+		hooks[n_hooks] = (struct hook){ .path = path };
+		hook_start(&hooks[n_hooks]);
+		n_hooks++;
 	}
 
+	hooks_wait(hooks, n_hooks, opts);
+
 	globfree(&globbuf);
 }
 
@@ -79,6 +261,22 @@ float get_uptime(void) {
 	exit(1);
 }
 
+/** Returns the time of the monotonic clock in microseconds */
+int64_t get_monotonic_time_us(void) {
+	struct timespec tv;
+	if (clock_gettime(CLOCK_MONOTONIC, &tv)) {
+		perror("autoupdater: error: clock_gettime");
+		exit(1);
+	}
+
+	return (int64_t)tv.tv_sec * 1000000 + tv.tv_nsec / 1000;
+}
+
+/** Returns the time of the monotonic clock in milliseconds */
+int64_t get_monotonic_time(void) {
+	return get_monotonic_time_us() / 1000;
+}
+
 void * safe_malloc(size_t size) {
 	void *ret = malloc(size);
 	if (!ret) {
@@ -2,12 +2,28 @@
 // SPDX-FileCopyrightText: 2017 Jan-Philipp Litza <janphilipp@litza.de>
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 
-void run_dir(const char *dir);
+/** Options for running hook scripts */
+struct hook_options {
+	/* run hooks with the same number in parallel */
+	bool parallel;
+	/* time after which a hook is killed (in seconds, 0 for no limit) */
+	unsigned timeout;
+	/* called for each finished hook with its duration (in us) */
+	void (*done_cb)(const char *path, int64_t duration, bool timed_out, void *arg);
+	void *arg;
+};
+
+
+void run_dir(const char *dir, const struct hook_options *opts);
 void randomize(void);
 float get_uptime(void);
+int64_t get_monotonic_time(void);
+int64_t get_monotonic_time_us(void);
 
 void * safe_malloc(size_t size);
 void * safe_realloc(void *ptr, size_t size);
@@ -40,6 +40,10 @@ struct interface_info {
 
 	unsigned int ifindex;
 	uint64_t max_multicast_delay;
+
+	/* pacing of responses to multicast requests (0 = unlimited) */
+	uint64_t rate_limit;
+	int64_t pace_time;
 };
 
 struct group_info {
@@ -68,6 +72,7 @@ struct request_task {
 	struct request_task *next;
 	int64_t scheduled_time;
 
+	struct interface_info *iface;
 	struct sockaddr_in6 client_addr;
 	char request[REQUEST_MAXLEN];
 };
@@ -93,6 +98,8 @@ static void usage() {
 	puts("        -i <string>      interface on which the group is joined");
 	puts("        -t <int>         maximum delay seconds before multicast responses");
 	puts("                         for the last specified multicast interface (default: 0)");
+	puts("        -r <int>         maximum bytes per second of multicast responses");
+	puts("                         for the last specified multicast interface (default: unlimited)");
 	puts("        -d <string>      data provider directory");
 	puts("        -h               this help\n");
 }
@@ -425,11 +432,13 @@ static struct json_object * handle_request(char *request, bool *compress) {
  * @result: Result json object to be send
  * @compress: True, if the answer should be compressed before sending
  * @addr: Ipv6 destination address for the answer
+ *
+ * Returns: The number of bytes sent
  */
-static void send_response(int sock, struct json_object *result, bool compress,
-			  struct sockaddr_in6 *addr) {
+static size_t send_response(int sock, struct json_object *result, bool compress,
+			    struct sockaddr_in6 *addr) {
 	const char *output = NULL;
-	size_t output_bytes;
+	size_t output_bytes = 0;
 
 	const char *str = json_object_to_json_string_ext(result, JSON_C_TO_STRING_PLAIN);
 
@@ -450,11 +459,32 @@ static void send_response(int sock, struct json_object *result, bool compress,
 	}
 
 	if (output) {
-		if (sendto(sock, output, output_bytes, 0, (struct sockaddr *) addr, sizeof(*addr)) < 0)
+		if (sendto(sock, output, output_bytes, 0, (struct sockaddr *) addr, sizeof(*addr)) < 0) {
 			perror("sendto failed");
+			output_bytes = 0;
+		}
 	}
 
 	json_object_put(result);
+
+	return output_bytes;
+}
+
+/**
+ * Account a sent response against the pacing budget of an interface
+ *
+ * The pace time of the interface is moved forward by the time the response
+ * occupies at the configured rate, so the next paced response on the same
+ * interface is not sent before that.
+ */
+static void pace_interface(struct interface_info *iface, size_t bytes) {
+	if (!iface || !iface->rate_limit)
+		return;
+
+	if (iface->pace_time < now)
+		iface->pace_time = now;
+
+	iface->pace_time += (UINT64_C(1000) * bytes + iface->rate_limit - 1) / iface->rate_limit;
 }
 
 /**
@@ -472,20 +502,22 @@ static void serve_request(struct request_task *task, int sock) {
 	if (!result)
 		return;
 
-	send_response(
+	size_t bytes = send_response(
 		sock,
 		result,
 		compress,
 		&task->client_addr
 	);
+
+	pace_interface(task->iface, bytes);
 }
 
-static const struct interface_info * find_multicast_interface(const struct group_info *groups, unsigned ifindex, const struct in6_addr *addr) {
+static struct interface_info * find_multicast_interface(const struct group_info *groups, unsigned ifindex, const struct in6_addr *addr) {
 	for (const struct group_info *group = groups; group; group = group->next) {
 		if (memcmp(addr, &group->address, sizeof(struct in6_addr)) != 0)
 			continue;
 
-		for (const struct interface_info *iface = group->interfaces; iface; iface = iface->next) {
+		for (struct interface_info *iface = group->interfaces; iface; iface = iface->next) {
 			if (ifindex != iface->ifindex)
 				continue;
 
@@ -510,7 +542,12 @@ static const struct interface_info * find_multicast_interface(const struct group
  * 2b. If so choose a random delay between 0 and max_multicast_delay milliseconds
  *     and schedule the request.
  * 2c. If not, send the request immediately.
- * 2d. If the schedule is full, send the reply immediately.
+ * 2d. If a rate limit is set for the incoming iface, the request is not
+ *     scheduled before the pace time of the iface, so the responses on
+ *     that iface do not exceed the configured bytes per second.
+ * 2e. If the schedule is full, send the reply immediately, unless a rate
+ *     limit is set for the iface; the request is dropped then, as an
+ *     immediate reply would exceed the limit.
  * 3a. If the incoming request was sent to a unicast destination, the response
  *     will be also sent immediately.
  */
@@ -580,7 +617,7 @@ static void accept_request(struct request_schedule *schedule, int sock,
 
 	input[input_bytes] = 0;
 
-	const struct interface_info *iface = NULL;
+	struct interface_info *iface = NULL;
 	if (IN6_IS_ADDR_MULTICAST(&destaddr)) {
 		iface = find_multicast_interface(groups, ifindex, &destaddr);
 		// this should not happen
@@ -592,13 +629,25 @@ static void accept_request(struct request_schedule *schedule, int sock,
 	// input_bytes cannot be greater than REQUEST_MAXLEN-1
 	memcpy(new_task->request, input, input_bytes + 1);
 	new_task->scheduled_time = 0;
+	new_task->iface = iface;
 	new_task->client_addr = addr;
 
 	bool is_scheduled;
-	if (iface && iface->max_multicast_delay) {
+	if (iface && (iface->max_multicast_delay || iface->rate_limit)) {
+		new_task->scheduled_time = now;
+		if (iface->max_multicast_delay)
+			new_task->scheduled_time += rand() % iface->max_multicast_delay;
+		if (new_task->scheduled_time < iface->pace_time)
+			new_task->scheduled_time = iface->pace_time;
+
 		// scheduling could fail because the schedule is full
-		new_task->scheduled_time = now + rand() % iface->max_multicast_delay;
 		is_scheduled = schedule_push_request(schedule, new_task);
+
+		// replying immediately would defeat the rate limit
+		if (!is_scheduled && iface->rate_limit) {
+			free(new_task);
+			return;
+		}
 	} else {
 		// unicast packets are always sent directly
 		is_scheduled = false;
@@ -654,7 +703,7 @@ int main(int argc, char **argv) {
 	openlog("respondd", LOG_PID, LOG_DAEMON);
 
 	int c;
-	while ((c = getopt(argc, argv, "p:g:t:i:d:h")) != -1) {
+	while ((c = getopt(argc, argv, "p:g:t:r:i:d:h")) != -1) {
 		switch (c) {
 		case 'p':
 			server_addr.sin6_port = htons(atoi(optarg));
@@ -687,6 +736,8 @@ int main(int argc, char **argv) {
 			struct interface_info *new_iface = malloc(sizeof(*new_iface));
 			new_iface->ifindex = ifindex;
 			new_iface->max_multicast_delay = MAX_MULTICAST_DELAY_DEFAULT;
+			new_iface->rate_limit = 0;
+			new_iface->pace_time = 0;
 			new_iface->next = groups->interfaces;
 			groups->interfaces = new_iface;
 
@@ -708,6 +759,22 @@ int main(int argc, char **argv) {
 
 			break;
 
+		case 'r':
+			if (!groups || !groups->interfaces) {
+				fprintf(stderr, "Interface must be given before response rate limit.\n");
+				exit(EXIT_FAILURE);
+			}
+
+			unsigned long rate_limit = strtoul(optarg, &endptr, 10);
+			if (!*optarg || *endptr || !rate_limit) {
+				fprintf(stderr, "Invalid response rate limit\n");
+				exit(EXIT_FAILURE);
+			}
+
+			groups->interfaces->rate_limit = rate_limit;
+
+			break;
+
 		case 'd':
 			load_providers(optarg);
 			break;
@@ -738,6 +805,13 @@ int main(int argc, char **argv) {
 		if (!task)
 			continue;
 
+		/* Another response has used up the budget of the iface in the meantime */
+		if (task->iface && task->iface->pace_time > now) {
+			task->scheduled_time = task->iface->pace_time;
+			schedule_push_request(&schedule, task);
+			continue;
+		}
+
 		serve_request(task, sock);
 		free(task);
 	}
@@ -4,9 +4,11 @@
 #include <generated/sse-multiplex.h>
 
 #include <errno.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -14,12 +16,18 @@
 #include <sys/un.h>
 
 
-int main(int argc, char *argv[]) {
-	if (argc != 2) {
-		fprintf(stderr, "Usage: %s <command>\n", argv[0]);
-		return 1;
-	}
+/** Maximum delay between two connection attempts (in seconds) */
+#define MAX_RECONNECT_DELAY 32
+
+
+/* ID of the last event written to stdout (or NULL) */
+static char *last_event_id = NULL;
+
+/* The HTTP header has been written to stdout */
+static bool header_sent = false;
 
+
+static int connect_socket(void) {
 	size_t socket_len = strlen(SSE_MULTIPLEX_SOCKET);
 	size_t len = offsetof(struct sockaddr_un, sun_path) + socket_len + 1;
 	uint8_t addrbuf[len];
@@ -33,30 +41,61 @@ int main(int argc, char *argv[]) {
 	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
 	if (fd < 0) {
 		fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
-		return 1;
+		return -1;
 	}
 
 	if (connect(fd, (struct sockaddr*)sa, sizeof(addrbuf)) < 0) {
 		fprintf(stderr, "Can't connect to `%s': %s\n", SSE_MULTIPLEX_SOCKET, strerror(errno));
-		return 1;
+		close(fd);
+		return -1;
 	}
 
-	char *command = argv[1];
-	while (command[0]) {
-		ssize_t w = write(fd, command, strlen(command));
+	return fd;
+}
+
+static bool write_all(int fd, const char *buf, size_t len) {
+	while (len) {
+		ssize_t w = write(fd, buf, len);
 		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+
 			fprintf(stderr, "Can't write command: %s\n", strerror(errno));
-			return 1;
+			return false;
 		}
 
-		command += w;
+		buf += w;
+		len -= w;
 	}
 
+	return true;
+}
+
+/**
+	Sends the command to the daemon
+
+	The ID of the last received event is appended after a null byte,
+	so the daemon can resume the stream after this event.
+*/
+static bool send_command(int fd, const char *command) {
+	if (!write_all(fd, command, strlen(command)))
+		return false;
+
+	if (last_event_id && !write_all(fd, "", 1))
+		return false;
+	if (last_event_id && !write_all(fd, last_event_id, strlen(last_event_id)))
+		return false;
+
 	if (shutdown(fd, SHUT_WR) < 0) {
 		fprintf(stderr, "shutdown: %s\n", strerror(errno));
-		return 1;
+		return false;
 	}
 
+	return true;
+}
+
+/** Copies the stream to stdout until the daemon closes the connection */
+static int copy_stream(int fd) {
 	setlinebuf(stdout);
 
 	char buf[1024];
@@ -74,3 +113,177 @@ int main(int argc, char *argv[]) {
 		fwrite(buf, r, 1, stdout);
 	}
 }
+
+/** Remembers the ID set by the last "id" field of a record */
+static void record_update_id(const char *record, size_t len) {
+	for (const char *line = record, *eol; line < record + len; line = eol + 1) {
+		eol = memchr(line, '\n', record + len - line);
+		if (!eol)
+			eol = record + len;
+
+		if (eol - line < 3 || memcmp(line, "id:", 3))
+			continue;
+
+		const char *id = line + 3;
+		if (id < eol && *id == ' ')
+			id++;
+
+		/* IDs containing null bytes can't be passed to the daemon */
+		if (memchr(id, 0, eol - id))
+			continue;
+
+		free(last_event_id);
+		last_event_id = strndup(id, eol - id);
+	}
+}
+
+/**
+	Writes a complete record to stdout
+
+	The header is only written for the first connection; the headers
+	received after reconnecting are discarded.
+*/
+static void output_record(const char *record, size_t len, bool header) {
+	if (header) {
+		if (header_sent)
+			return;
+		header_sent = true;
+	}
+	else {
+		record_update_id(record, len);
+	}
+
+	if (fwrite(record, len, 1, stdout) != 1 || fflush(stdout) != 0) {
+		fprintf(stderr, "write: %s\n", strerror(errno));
+		exit(1);
+	}
+}
+
+/**
+	Receives complete records until the connection is closed
+
+	Incomplete records are discarded when the connection is lost, so the
+	output can be continued from the next connection without corrupting
+	the stream. Returns true if any record has been received.
+*/
+static bool receive_records(int fd) {
+	static char *buf = NULL;
+	static size_t buflen = 0;
+
+	size_t len = 0, scanned = 0;
+	bool header = true, received = false;
+
+	while (true) {
+		char *sep;
+		while ((sep = memmem(buf + scanned, len - scanned, "\n\n", 2))) {
+			size_t record_len = (sep + 2) - buf;
+			output_record(buf, record_len, header);
+
+			header = false;
+			received = true;
+
+			len -= record_len;
+			memmove(buf, buf + record_len, len);
+			scanned = 0;
+		}
+
+		if (len)
+			scanned = len - 1;
+
+		if (len == buflen) {
+			buflen = buflen ? 2*buflen : 4096;
+			buf = realloc(buf, buflen);
+			if (!buf) {
+				fprintf(stderr, "realloc: %s\n", strerror(errno));
+				exit(1);
+			}
+		}
+
+		ssize_t r = recv(fd, buf + len, buflen - len, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			fprintf(stderr, "read: %s\n", strerror(errno));
+		if (r <= 0)
+			return received;
+
+		len += r;
+	}
+}
+
+/** Follows the stream, reconnecting whenever the connection is lost */
+static void follow_stream(const char *command) __attribute__((noreturn));
+static void follow_stream(const char *command) {
+	unsigned delay = 1;
+
+	while (true) {
+		int fd = connect_socket();
+		if (fd >= 0) {
+			if (send_command(fd, command) && receive_records(fd))
+				delay = 1;
+
+			close(fd);
+		}
+
+		sleep(delay);
+		if (delay < MAX_RECONNECT_DELAY)
+			delay *= 2;
+	}
+}
+
+static void usage(const char *name) {
+	fprintf(stderr,
+		"Usage: %s [-r] [-i <id>] <command>\n"
+		"  -r       reconnect when the connection is lost, resuming after the last event\n"
+		"  -i <id>  resume after the event with the given ID (default: $HTTP_LAST_EVENT_ID)\n",
+		name
+	);
+}
+
+int main(int argc, char *argv[]) {
+	bool reconnect = false;
+	const char *id = getenv("HTTP_LAST_EVENT_ID");
+
+	int c;
+	while ((c = getopt(argc, argv, "+ri:h")) != -1) {
+		switch (c) {
+		case 'r':
+			reconnect = true;
+			break;
+
+		case 'i':
+			id = optarg;
+			break;
+
+		case 'h':
+			usage(argv[0]);
+			return 0;
+
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (argc - optind != 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	const char *command = argv[optind];
+
+	if (id && *id)
+		last_event_id = strdup(id);
+
+	if (reconnect)
+		follow_stream(command);
+
+	int fd = connect_socket();
+	if (fd < 0)
+		return 1;
+
+	if (!send_command(fd, command))
+		return 1;
+
+	return copy_stream(fd);
+}
@@ -13,21 +13,60 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/types.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 
+/** Size of the per-provider ring buffer, must be a power of two */
+#define RING_SIZE 65536
+
+/** Size of the buffer provider output is read into */
+#define READ_SIZE 16384
+
+/** Maximum number of events handled per epoll_wait() */
+#define MAX_EVENTS 32
+
+/** Number of record start positions remembered per provider */
+#define MAX_RECORDS 64
+
+/** Minimum time between two starts of a pre-spawned command (in ms) */
+#define RESPAWN_DELAY 5000
+
+/** Number of buckets of the provider hash table */
+#define PROVIDER_HASH_SIZE 64
+
+/** Maximum length of a command sent by a client */
+#define MAX_COMMAND_LEN 1023
+
+/** Built-in command streaming the multiplexer's own statistics */
+#define METRICS_COMMAND "@metrics"
+
+/** Interval between two records of the metrics stream (in ms) */
+#define METRICS_INTERVAL 1000
+
+
+typedef struct connection connection_t;
 typedef struct client client_t;
 typedef struct provider provider_t;
 
 typedef void (*handler_t)(provider_t *, void *buffer, size_t len);
 
 
+/** What to do with a client whose queue exceeds the limit */
+typedef enum {
+	OVERFLOW_DROP_OLDEST,
+	OVERFLOW_SKIP_TO_LATEST,
+	OVERFLOW_DISCONNECT,
+} overflow_policy_t;
+
+
 static volatile bool running = true;
 
 static int epoll_fd = -1;
@@ -36,42 +75,177 @@ static struct epoll_event listen_event = {};
 
 static provider_t *providers = NULL;
 
+/* Connections whose command has not been received yet, oldest first */
+static connection_t *connections = NULL;
+static connection_t *connections_tail = NULL;
+
+/* Running providers by command */
+static provider_t *provider_hash[PROVIDER_HASH_SIZE] = {};
+
+static size_t client_queue_limit = RING_SIZE/4;
+static overflow_policy_t overflow_policy = OVERFLOW_DROP_OLDEST;
+static unsigned replay_records = 0;
+
+/* Time a connection may take to send its command (in ms) */
+static int64_t command_timeout = 5000;
+
+/* Time providers are kept without clients (in ms) */
+static int64_t linger_time = 0;
+
+/* Commands that are started in advance and kept running without clients */
+static size_t n_prespawn = 0;
+static const char **prespawn_commands = NULL;
+static int64_t *prespawn_times = NULL;
+
+static int64_t now;
+
+/* Time the next record of the metrics stream is generated */
+static int64_t metrics_next = 0;
+
+/* Totals since the start of the daemon */
+static struct {
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	unsigned forks;
+	unsigned disconnects;
+} stats = {};
+
+/* Events returned by the current epoll_wait() call */
+static struct epoll_event events[MAX_EVENTS];
+static int n_events = 0;
+
+
+/**
+	Type of the object an epoll event's data pointer refers to
+
+	Each object registered with epoll (except for the listening socket)
+	has a source_t as its first member.
+*/
+typedef enum {
+	SOURCE_PROVIDER,
+	SOURCE_CLIENT,
+	SOURCE_CONNECTION,
+} source_t;
 
 typedef enum {
 	CLIENT_STATE_NEW = 0,
-	CLIENT_STATE_HEADER_SENT,
+	/* Writing, has received all data available so far */
 	CLIENT_STATE_ACTIVE,
+	/* Writing, waiting for the socket to become writable */
+	CLIENT_STATE_BLOCKED,
 	CLIENT_STATE_CLOSE,
+
+	CLIENT_STATE_MAX,
 } client_state_t;
 
 
+/** A connection that is still sending its command */
+struct connection {
+	source_t source;
+	struct connection *prev;
+	struct connection *next;
+
+	int fd;
+	struct epoll_event event;
+	/* Time the connection is closed if the command is incomplete */
+	int64_t deadline;
+
+	size_t command_len;
+	char command[MAX_COMMAND_LEN+1];
+	/* The Last-Event-ID didn't fit into the buffer and is ignored */
+	bool id_discarded;
+};
+
 struct client {
+	source_t source;
 	struct client *next;
+	struct client **pprev;
 
+	provider_t *provider;
 	int fd;
+	struct epoll_event event;
 	client_state_t state;
+
+	/* Number of header bytes already written */
+	size_t header_pos;
+	/* Position of the next byte to write in the provider's ring */
+	uint64_t pos;
+	/* pos is the start of an SSE record */
+	bool record_start;
+
+	/* Data skipped because of the overflow policy */
+	uint64_t skipped_bytes;
+	unsigned skips;
+
+	/* ID of the last event the client has received before (or NULL) */
+	char *last_event_id;
 };
 
 struct provider {
+	source_t source;
 	struct provider *prev;
 	struct provider *next;
+	struct provider *hash_next;
 
+	uint32_t hash;
 	char *command;
 	int fd;
 	struct epoll_event event;
 
+	/*
+		Ring buffer of the data following the header. Positions are
+		counted from the start of the stream, so the ring contains the
+		bytes from head - RING_SIZE to head.
+	*/
+	char *ring;
+	uint64_t head;
+
+	/*
+		Start positions of the most recent SSE records, the newest one
+		is the start of the current (incomplete) record
+	*/
+	uint64_t records[MAX_RECORDS];
+	size_t n_records;
+
+	/* Statistics of the clients' overflow handling */
+	uint64_t skipped_bytes;
+	unsigned skips;
+	unsigned disconnects;
+
+	/* Bytes read from the command and written to all clients */
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+
 	size_t header_buflen;
 	size_t header_len;
 	char *header;
 
 	char last;
 	bool clean;
+	/* The command has exited, remaining data is still sent to the clients */
+	bool eof;
+	/* Reading is paused until a client has caught up */
+	bool paused;
+	/* Pre-spawned provider, kept without clients */
+	bool persistent;
+	/* Time the provider is deleted if no client has connected (0 = has clients) */
+	int64_t linger_until;
 
 	handler_t handler;
-	client_t *clients;
+
+	/* Clients by state */
+	client_t *clients[CLIENT_STATE_MAX];
+	size_t n_clients;
 };
 
 
+static void update_time(void) {
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+
+	now = (int64_t)tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+}
+
 static int run_command(const char *command) {
 	int pipefd[2];
 	if (pipe2(pipefd, O_CLOEXEC) < 0) {
@@ -88,6 +262,7 @@ static int run_command(const char *command) {
 	}
 
 	if (pid > 0) {
+		stats.forks++;
 		close(pipefd[1]);
 		return pipefd[0];
 	}
@@ -106,57 +281,455 @@ static int run_command(const char *command) {
 	}
 }
 
-/** Write a whole buffer to a FD, retrying on partial writes */
-static bool feed(int fd, void *buffer, size_t len) {
-	while (len) {
-		ssize_t w = write(fd, buffer, len);
-		if (w == 0)
-			return false;
-		if (w < 0) {
-			if (errno == EINTR)
-				continue;
+/**
+	Removes an object that is about to be freed from the pending events
+
+	The events returned by epoll_wait() are handled in a batch; handling
+	one event may free objects that are referenced by the following events
+	of the same batch.
+*/
+static void events_forget(void *ptr) {
+	for (int i = 0; i < n_events; i++) {
+		if (events[i].data.ptr == ptr)
+			events[i].data.ptr = NULL;
+	}
+}
+
+/** Returns the start of the newest record, which is still incomplete */
+static uint64_t provider_current_record(const provider_t *p) {
+	return p->records[(p->n_records - 1) % MAX_RECORDS];
+}
 
-			return false;
+/** Returns the start of the i-th newest record (i = 0 is the current record) */
+static bool provider_get_record(const provider_t *p, size_t i, uint64_t *pos) {
+	if (i >= p->n_records || i >= MAX_RECORDS)
+		return false;
+
+	*pos = p->records[(p->n_records - 1 - i) % MAX_RECORDS];
+	return true;
+}
+
+static void provider_add_record(provider_t *p, uint64_t pos) {
+	p->records[p->n_records % MAX_RECORDS] = pos;
+	p->n_records++;
+}
+
+/** Checks if a position is the start of a remembered record */
+static bool provider_is_record_start(const provider_t *p, uint64_t pos) {
+	uint64_t record;
+	for (size_t i = 0; provider_get_record(p, i, &record); i++) {
+		if (record <= pos)
+			return record == pos;
+	}
+
+	return false;
+}
+
+/**
+	Returns the start of the first record following a position, or the
+	ring head if the record at the position is still incomplete
+*/
+static uint64_t provider_next_record(const provider_t *p, uint64_t pos) {
+	uint64_t ret = p->head, record;
+	for (size_t i = 0; provider_get_record(p, i, &record) && record > pos; i++)
+		ret = record;
+
+	return ret;
+}
+
+/**
+	Returns the position new clients start receiving data at
+
+	This is the start of the current record, or of the last replay_records
+	complete records, as far as they are still in the ring and fit the
+	client queue limit.
+*/
+static uint64_t provider_replay_start(const provider_t *p) {
+	uint64_t pos = provider_current_record(p), record;
+	for (size_t i = 1; i <= replay_records && provider_get_record(p, i, &record); i++) {
+		if (p->head - record > client_queue_limit)
+			break;
+
+		pos = record;
+	}
+
+	return pos;
+}
+
+/** Returns the ID of a record in the ring, as set by its last "id" field */
+static bool provider_record_id(const provider_t *p, uint64_t start, uint64_t end, const char **id, size_t *id_len) {
+	static char record[RING_SIZE];
+	size_t len = end - start;
+
+	size_t offset = start & (RING_SIZE-1);
+	size_t len1 = RING_SIZE - offset;
+	if (len1 > len)
+		len1 = len;
+
+	memcpy(record, p->ring + offset, len1);
+	memcpy(record + len1, p->ring, len - len1);
+
+	bool found = false;
+	for (const char *line = record, *eol; line < record + len; line = eol + 1) {
+		eol = memchr(line, '\n', record + len - line);
+		if (!eol)
+			eol = record + len;
+
+		if (eol - line < 3 || memcmp(line, "id:", 3))
+			continue;
+
+		*id = line + 3;
+		if (*id < eol && **id == ' ')
+			(*id)++;
+		*id_len = eol - *id;
+		found = true;
+	}
+
+	return found;
+}
+
+/**
+	Finds the position following the record with the given event ID
+
+	Only the complete records that are still in the ring are searched,
+	starting with the newest one.
+*/
+static bool provider_find_event(const provider_t *p, const char *event_id, uint64_t *pos) {
+	size_t event_id_len = strlen(event_id);
+	uint64_t start, end = provider_current_record(p);
+
+	for (size_t i = 1; provider_get_record(p, i, &start); i++) {
+		if (p->head - start > RING_SIZE)
+			break;
+
+		const char *id;
+		size_t id_len;
+		if (provider_record_id(p, start, end, &id, &id_len) &&
+		    id_len == event_id_len && !memcmp(id, event_id, id_len)) {
+			*pos = end;
+			return true;
 		}
 
-		buffer += w;
-		len -= w;
+		end = start;
 	}
 
-	return true;
+	return false;
+}
+
+static void client_list_add(client_t **list, client_t *c) {
+	c->next = *list;
+	if (c->next)
+		c->next->pprev = &c->next;
+
+	c->pprev = list;
+	*list = c;
+}
+
+static void client_list_del(client_t *c) {
+	*c->pprev = c->next;
+	if (c->next)
+		c->next->pprev = c->pprev;
+}
+
+/**
+	Moves a client to the provider's client list for a new state
+
+	Active clients are polled for writability while they are blocked.
+*/
+static void client_set_state(client_t *c, client_state_t state) {
+	if (c->state == state)
+		return;
+
+	client_list_del(c);
+	c->state = state;
+	client_list_add(&c->provider->clients[state], c);
+
+	if (state != CLIENT_STATE_ACTIVE && state != CLIENT_STATE_BLOCKED)
+		return;
+
+	uint32_t events = (state == CLIENT_STATE_BLOCKED) ? EPOLLOUT : 0;
+	if (c->event.events == events)
+		return;
+
+	c->event.events = events;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &c->event) < 0) {
+		fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+		exit(1);
+	}
 }
 
 /**
 	Creates a new client for a given socket FD and adds
 	it to a provider's client list
+
+	A client passing the ID of the last event it has received resumes
+	after that event if it is still in the provider's history. The client
+	takes ownership of the last_event_id string.
 */
-static void client_add(provider_t *p, int fd) {
+static void client_add(provider_t *p, int fd, char *last_event_id) {
 	client_t *c = calloc(1, sizeof(*c));
+	c->source = SOURCE_CLIENT;
+	c->provider = p;
 	c->fd = fd;
+	c->state = CLIENT_STATE_NEW;
+	c->last_event_id = last_event_id;
+
+	/*
+		Clients are only polled for writability while their socket
+		buffer is full; hangups are always reported by epoll.
+	*/
+	c->event.events = 0;
+	c->event.data.ptr = c;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &c->event) < 0) {
+		fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+		exit(1);
+	}
 
-	c->next = p->clients;
-	p->clients = c;
+	client_list_add(&p->clients[CLIENT_STATE_NEW], c);
+	p->n_clients++;
 }
 
-/** Writes a buffer to a client's FD if the client is active */
-static void client_feed(client_t *c, void *buffer, size_t len) {
-	if (!feed(c->fd, buffer, len))
-		c->state = CLIENT_STATE_CLOSE;
+/**
+	Applies the overflow policy to a client whose queue exceeds the limit
+
+	The client must be at the start of a record, so skipping data never
+	cuts a record in half. Returns false if the client has been
+	disconnected.
+*/
+static bool client_overflow(client_t *c) {
+	provider_t *p = c->provider;
+	uint64_t pos = provider_current_record(p), record;
+
+	switch (overflow_policy) {
+	case OVERFLOW_DROP_OLDEST:
+		/* Skip to the oldest record that fits the limit */
+		for (size_t i = 1; provider_get_record(p, i, &record); i++) {
+			if (p->head - record > client_queue_limit)
+				break;
+
+			pos = record;
+		}
+		break;
+
+	case OVERFLOW_SKIP_TO_LATEST:
+		/* Skip to the newest complete record */
+		if (provider_get_record(p, 1, &record) && p->head - record <= RING_SIZE)
+			pos = record;
+		break;
+
+	case OVERFLOW_DISCONNECT:
+		p->disconnects++;
+		stats.disconnects++;
+		client_set_state(c, CLIENT_STATE_CLOSE);
+		return false;
+	}
+
+	if (pos <= c->pos)
+		return true;
+
+	c->skipped_bytes += pos - c->pos;
+	c->skips++;
+	p->skipped_bytes += pos - c->pos;
+	p->skips++;
+
+	c->pos = pos;
+	return true;
+}
+
+/**
+	Writes as much pending data to an active client as its socket accepts
+
+	The remaining header and the unsent part of the ring are written with a
+	single writev(). When the socket buffer is full, the client is polled
+	for writability and the write continues from epoll_handle_client().
+
+	When more than client_queue_limit bytes are pending, the client first
+	completes the record it is in, and then the overflow policy is applied.
+	A client whose current record has already been overwritten in the ring
+	is dropped.
+*/
+static void client_flush(client_t *c) {
+	provider_t *p = c->provider;
+
+	if (c->state != CLIENT_STATE_ACTIVE && c->state != CLIENT_STATE_BLOCKED)
+		return;
+
+	while (true) {
+		uint64_t end = p->head;
+
+		if (p->head - c->pos > client_queue_limit && c->record_start) {
+			if (!client_overflow(c))
+				return;
+		}
+
+		/* The overflow policy may not have found a record that is still in the ring */
+		if (p->head - c->pos > RING_SIZE) {
+			syslog(LOG_INFO, "dropping slow client of `%s'", p->command);
+			p->disconnects++;
+			stats.disconnects++;
+			client_set_state(c, CLIENT_STATE_CLOSE);
+			return;
+		}
+
+		if (p->head - c->pos > client_queue_limit && !c->record_start)
+			end = provider_next_record(p, c->pos);
+
+		if (c->header_pos == p->header_len && c->pos == end)
+			break;
+
+		struct iovec iov[3];
+		int n = 0;
+
+		if (c->header_pos < p->header_len) {
+			iov[n].iov_base = p->header + c->header_pos;
+			iov[n].iov_len = p->header_len - c->header_pos;
+			n++;
+		}
+
+		size_t start = c->pos & (RING_SIZE-1);
+		size_t len = end - c->pos;
+		if (start + len > RING_SIZE) {
+			iov[n].iov_base = p->ring + start;
+			iov[n].iov_len = RING_SIZE - start;
+			n++;
+
+			len -= RING_SIZE - start;
+			start = 0;
+		}
+		if (len) {
+			iov[n].iov_base = p->ring + start;
+			iov[n].iov_len = len;
+			n++;
+		}
+
+		ssize_t w = writev(c->fd, iov, n);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				client_set_state(c, CLIENT_STATE_BLOCKED);
+				return;
+			}
+
+			client_set_state(c, CLIENT_STATE_CLOSE);
+			return;
+		}
+
+		p->bytes_out += w;
+		stats.bytes_out += w;
+
+		size_t header_left = p->header_len - c->header_pos;
+		if ((size_t)w <= header_left) {
+			c->header_pos += w;
+		}
+		else {
+			c->header_pos = p->header_len;
+			c->pos += w - header_left;
+			c->record_start = provider_is_record_start(p, c->pos);
+		}
+	}
+
+	client_set_state(c, CLIENT_STATE_ACTIVE);
 }
 
 static void client_free(client_t *c) {
+	if (c->skips)
+		syslog(LOG_DEBUG, "client of `%s' skipped %llu bytes in %u steps",
+		       c->provider->command, (unsigned long long)c->skipped_bytes, c->skips);
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL) < 0) {
+		fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	events_forget(c);
+
 	close(c->fd);
+	free(c->last_event_id);
 	free(c);
 }
 
-/** Writes a buffer to all active clients of a given provider */
+/**
+	Removes a connection from epoll and the list of pending connections
+
+	The socket is closed unless it is handed over to a client.
+*/
+static void connection_free(connection_t *conn, bool close_fd) {
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL) < 0) {
+		fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	events_forget(conn);
+
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else
+		connections = conn->next;
+
+	if (conn->next)
+		conn->next->prev = conn->prev;
+	else
+		connections_tail = conn->prev;
+
+	if (close_fd)
+		close(conn->fd);
+	free(conn);
+}
+
+/** Appends a buffer to a provider's ring */
+static void ring_append(provider_t *provider, const char *buffer, size_t len) {
+	if (len > RING_SIZE) {
+		buffer += len - RING_SIZE;
+		provider->head += len - RING_SIZE;
+		len = RING_SIZE;
+	}
+
+	size_t start = provider->head & (RING_SIZE-1);
+	size_t len1 = RING_SIZE - start;
+	if (len1 > len)
+		len1 = len;
+
+	memcpy(provider->ring + start, buffer, len1);
+	memcpy(provider->ring, buffer + len1, len - len1);
+
+	provider->head += len;
+}
+
+/**
+	Adds a buffer to a provider's ring and writes it to all active clients
+
+	The buffer is written to each client directly unless the client is
+	blocked waiting for its socket to become writable; such clients catch
+	up from the ring later, so a slow client never delays the others.
+*/
 static void provider_handle_data(provider_t *provider, void *buffer, size_t len) {
 	if (!len)
 		return;
 
-	for (client_t *c = provider->clients; c; c = c->next) {
-		if (c->state == CLIENT_STATE_ACTIVE)
-			client_feed(c, buffer, len);
+	provider->bytes_in += len;
+	stats.bytes_in += len;
+
+	/*
+		Remember the start of each record. prev is the character preceding
+		the buffer, so double newlines spanning two reads are found as well.
+	*/
+	const char *data = buffer;
+	char prev = provider->head ? provider->ring[(provider->head-1) & (RING_SIZE-1)] : 0;
+	for (const char *nl = data; (nl = memchr(nl, '\n', data + len - nl)); nl++) {
+		if ((nl > data ? nl[-1] : prev) == '\n')
+			provider_add_record(provider, provider->head + (nl + 1 - data));
+	}
+
+	ring_append(provider, buffer, len);
+
+	/* client_flush() moves the client to another list if it gets blocked */
+	client_t *next;
+	for (client_t *c = provider->clients[CLIENT_STATE_ACTIVE]; c; c = next) {
+		next = c->next;
+		client_flush(c);
 	}
 }
 
@@ -176,6 +749,9 @@ static void provider_handle_header(provider_t *provider, void *buffer, size_t le
 	if (!len)
 		return;
 
+	provider->bytes_in += len;
+	stats.bytes_in += len;
+
 	size_t new_len = provider->header_len + len;
 	if (new_len < provider->header_len)
 		goto overflow;
@@ -211,26 +787,149 @@ overflow:
 	return;
 }
 
+/** FNV-1a hash of a command */
+static uint32_t hash_command(const char *command) {
+	uint32_t hash = 2166136261u;
+	for (const unsigned char *c = (const unsigned char *)command; *c; c++) {
+		hash ^= *c;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static void provider_unhash(provider_t *p) {
+	for (provider_t **pp = &provider_hash[p->hash % PROVIDER_HASH_SIZE]; *pp; pp = &(*pp)->hash_next) {
+		if (*pp == p) {
+			*pp = p->hash_next;
+			return;
+		}
+	}
+}
+
+static void json_string(FILE *f, const char *str) {
+	fputc('"', f);
+
+	for (const unsigned char *c = (const unsigned char *)str; *c; c++) {
+		if (*c == '"' || *c == '\\')
+			fprintf(f, "\\%c", *c);
+		else if (*c < 0x20)
+			fprintf(f, "\\u%04x", *c);
+		else
+			fputc(*c, f);
+	}
+
+	fputc('"', f);
+}
+
+static double fanout(uint64_t bytes_in, uint64_t bytes_out) {
+	return bytes_in ? (double)bytes_out / bytes_in : 0;
+}
+
+/**
+	Generates a record of the metrics stream
+
+	The record is a single JSON object with the totals of the daemon and
+	the statistics of each provider, including the queue depth (bytes not
+	yet written) of each of its clients.
+*/
+static void metrics_record(provider_t *metrics) {
+	char *buf;
+	size_t len;
+	FILE *f = open_memstream(&buf, &len);
+	if (!f)
+		return;
+
+	size_t n_providers = 0, n_clients = 0;
+	for (provider_t *p = providers; p; p = p->next) {
+		n_providers++;
+		n_clients += p->n_clients;
+	}
+
+	fprintf(f,
+		"event: metrics\ndata: {\"providers\":%zu,\"clients\":%zu,\"forks\":%u,"
+		"\"dropped_clients\":%u,\"bytes_in\":%llu,\"bytes_out\":%llu,\"fanout\":%.2f,"
+		"\"commands\":[",
+		n_providers, n_clients, stats.forks, stats.disconnects,
+		(unsigned long long)stats.bytes_in, (unsigned long long)stats.bytes_out,
+		fanout(stats.bytes_in, stats.bytes_out));
+
+	for (provider_t *p = providers; p; p = p->next) {
+		fprintf(f, "%s{\"command\":", p == providers ? "" : ",");
+		json_string(f, p->command);
+		fprintf(f,
+			",\"running\":%s,\"clients\":%zu,\"bytes_in\":%llu,\"bytes_out\":%llu,"
+			"\"fanout\":%.2f,\"dropped_clients\":%u,\"skipped_bytes\":%llu,\"queues\":[",
+			p->eof ? "false" : "true", p->n_clients,
+			(unsigned long long)p->bytes_in, (unsigned long long)p->bytes_out,
+			fanout(p->bytes_in, p->bytes_out), p->disconnects,
+			(unsigned long long)p->skipped_bytes);
+
+		bool first = true;
+		for (int state = CLIENT_STATE_ACTIVE; state <= CLIENT_STATE_BLOCKED; state++) {
+			for (client_t *c = p->clients[state]; c; c = c->next) {
+				uint64_t depth = (p->header_len - c->header_pos) + (p->head - c->pos);
+				fprintf(f, "%s%llu", first ? "" : ",", (unsigned long long)depth);
+				first = false;
+			}
+		}
+
+		fputs("]}", f);
+	}
+
+	fputs("]}\n\n", f);
+
+	if (fclose(f) == 0)
+		metrics->handler(metrics, buf, len);
+
+	free(buf);
+}
+
+/** Sets up the header and the first record of the metrics provider */
+static void metrics_start(provider_t *metrics) {
+	static const char header[] = "Content-Type: text/event-stream\n\n";
+
+	metrics->clean = true;
+	metrics->handler(metrics, (void *)header, sizeof(header)-1);
+
+	metrics_record(metrics);
+	metrics_next = now + METRICS_INTERVAL;
+}
+
 /** Runs the given command, creating a new provider for the command's stdout pipe */
 static provider_t * provider_new(const char *command) {
-	int fd = run_command(command);
-	if (fd < 0) {
-		syslog(LOG_WARNING, "unable to run command `%s'", command);
-		return NULL;
-	}
+	bool metrics = !strcmp(command, METRICS_COMMAND);
+
+	int fd = -1;
+	if (!metrics) {
+		fd = run_command(command);
+		if (fd < 0) {
+			syslog(LOG_WARNING, "unable to run command `%s'", command);
+			return NULL;
+		}
 
-	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	}
 
 	provider_t *p = calloc(1, sizeof(*p));
+	p->source = SOURCE_PROVIDER;
+	p->hash = hash_command(command);
 	p->command = strdup(command);
 	p->fd = fd;
+	p->ring = malloc(RING_SIZE);
+	provider_add_record(p, 0);
+
+	for (size_t i = 0; i < n_prespawn; i++) {
+		if (!strcmp(prespawn_commands[i], command))
+			p->persistent = true;
+	}
 
 	p->handler = provider_handle_header;
 
-	p->event.events = EPOLLIN|EPOLLRDHUP;
+	p->event.events = EPOLLIN|EPOLLRDHUP|EPOLLET;
 	p->event.data.ptr = p;
 
-	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &p->event) < 0) {
+	if (fd >= 0 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &p->event) < 0) {
 		fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
 		exit(1);
 	}
@@ -240,23 +939,61 @@ static provider_t * provider_new(const char *command) {
 	p->next = providers;
 	providers = p;
 
+	provider_t **bucket = &provider_hash[p->hash % PROVIDER_HASH_SIZE];
+	p->hash_next = *bucket;
+	*bucket = p;
+
+	if (metrics)
+		metrics_start(p);
+
 	return p;
 }
 
+/** Retrieves the running provider for the given command */
+static provider_t * provider_find(const char *command) {
+	uint32_t hash = hash_command(command);
+
+	provider_t *p;
+	for (p = provider_hash[hash % PROVIDER_HASH_SIZE]; p; p = p->hash_next) {
+		if (p->hash == hash && !strcmp(p->command, command))
+			return p;
+	}
+
+	return NULL;
+}
+
 /**
 	Either retrieves an existing provider for the given command or
 	creates a new one if none exists
 */
 static provider_t * provider_get(const char *command) {
-	provider_t *p;
-	for (p = providers; p; p = p->next) {
-		if (!strcmp(p->command, command))
-			return p;
-	}
+	provider_t *p = provider_find(command);
+	if (p)
+		return p;
 
 	return provider_new(command);
 }
 
+/**
+	Stops reading from a provider whose command has exited
+
+	The provider is kept until the remaining data has been sent to all
+	clients.
+*/
+static void provider_eof(provider_t *p) {
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, p->fd, NULL) < 0) {
+		fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	close(p->fd);
+	p->fd = -1;
+	p->eof = true;
+
+	/* Clients connecting from now on get a new provider */
+	provider_unhash(p);
+}
+
 /**
 	Cleans up behind a provider, removes it from the global provider list
 	and frees the provider */
@@ -269,18 +1006,29 @@ static void provider_del(provider_t *p) {
 	else
 		providers = p->next;
 
-	if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, p->fd, NULL) < 0) {
-		fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
-		exit(1);
+	if (!p->eof)
+		provider_unhash(p);
+
+	if (p->fd >= 0) {
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, p->fd, NULL) < 0) {
+			fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+			exit(1);
+		}
+
+		close(p->fd);
 	}
 
-	for (client_t *c = p->clients; c; c = p->clients) {
-		p->clients = c->next;
-		client_free(c);
+	for (int state = 0; state < CLIENT_STATE_MAX; state++) {
+		for (client_t *c = p->clients[state]; c; c = p->clients[state]) {
+			p->clients[state] = c->next;
+			client_free(c);
+		}
 	}
 
+	events_forget(p);
+
 	free(p->command);
-	close(p->fd);
+	free(p->ring);
 	free(p->header);
 	free(p);
 }
@@ -288,61 +1036,164 @@ static void provider_del(provider_t *p) {
 /**
 	Periodic maintenance
 
-	New clients are activated as soon as the input is clean (we have just
-	read a double newline); clients that have failed are deleted.
+	New clients are activated as soon as the header is complete; they start
+	receiving data at the beginning of the current SSE record, preceded by
+	the replayed history of complete records. Clients that have failed are
+	deleted.
 
 	When all clients have been removed, the provider itself is deleted and
-	false is returned.
+	false is returned, unless it is persistent or lingering: such providers
+	keep running, so clients connecting later attach to a warm stream.
 */
 static bool provider_maintain(provider_t *p) {
-	for (client_t **cp = &p->clients, *c = *cp; c; c = *cp) {
-		switch (c->state) {
-		case CLIENT_STATE_NEW:
-			if (p->handler == provider_handle_header)
-				break;
+	client_t *c, *next;
 
-			/*
-				Set state first, in case client_feed()
-				sets the state to CLIENT_STATE_CLOSE
-			*/
-			c->state = CLIENT_STATE_HEADER_SENT;
-			client_feed(c, p->header, p->header_len);
-			continue;
+	if (p->handler != provider_handle_header) {
+		while ((c = p->clients[CLIENT_STATE_NEW])) {
+			/* Wait for the next record if the current one doesn't fit the ring */
+			if (p->head - provider_current_record(p) > RING_SIZE) {
+				if (!p->eof)
+					break;
 
-		case CLIENT_STATE_HEADER_SENT:
-			if (p->clean)
-				c->state = CLIENT_STATE_ACTIVE;
+				client_set_state(c, CLIENT_STATE_CLOSE);
+				continue;
+			}
 
-			break;
+			if (!c->last_event_id || !provider_find_event(p, c->last_event_id, &c->pos))
+				c->pos = provider_replay_start(p);
+			c->record_start = true;
 
-		case CLIENT_STATE_ACTIVE:
-			break;
+			free(c->last_event_id);
+			c->last_event_id = NULL;
+			client_set_state(c, CLIENT_STATE_ACTIVE);
+			client_flush(c);
+		}
+	}
 
-		case CLIENT_STATE_CLOSE:
-			*cp = c->next;
-			client_free(c);
-			continue;
+	/* Close the clients after all data of a finished provider has been sent */
+	if (p->eof) {
+		for (c = p->clients[CLIENT_STATE_ACTIVE]; c; c = next) {
+			next = c->next;
+
+			if (c->header_pos == p->header_len && c->pos == p->head)
+				client_set_state(c, CLIENT_STATE_CLOSE);
 		}
+	}
 
-		cp = &c->next;
+	while ((c = p->clients[CLIENT_STATE_CLOSE])) {
+		client_list_del(c);
+		p->n_clients--;
+		client_free(c);
 	}
 
-	if (!p->clients) {
-		provider_del(p);
-		return false;
+	if (p->n_clients) {
+		p->linger_until = 0;
+		return true;
 	}
 
-	return true;
+	if (!p->eof && p->persistent)
+		return true;
+
+	if (!p->eof && linger_time) {
+		if (!p->linger_until) {
+			update_time();
+			p->linger_until = now + linger_time;
+		}
+
+		return true;
+	}
+
+	provider_del(p);
+	return false;
+}
+
+/** Closes connections that have not sent their command in time */
+static void connections_expire(void) {
+	/* All connections have the same timeout, so the oldest one expires first */
+	while (connections && connections->deadline <= now) {
+		syslog(LOG_DEBUG, "timeout receiving command");
+		connection_free(connections, true);
+	}
+}
+
+/** Deletes lingering providers without clients whose time is up */
+static void providers_expire(void) {
+	provider_t *next;
+	for (provider_t *p = providers; p; p = next) {
+		next = p->next;
+
+		if (!p->n_clients && p->linger_until && p->linger_until <= now)
+			provider_del(p);
+	}
+}
+
+/** Starts pre-spawned commands that are not running */
+static void prespawn(void) {
+	for (size_t i = 0; i < n_prespawn; i++) {
+		if (provider_find(prespawn_commands[i]))
+			continue;
+
+		if (prespawn_times[i] && now - prespawn_times[i] < RESPAWN_DELAY)
+			continue;
+
+		prespawn_times[i] = now;
+		provider_new(prespawn_commands[i]);
+	}
+}
+
+/** Generates the next record of the metrics stream when it is due */
+static void metrics_update(void) {
+	provider_t *p = provider_find(METRICS_COMMAND);
+	if (!p || metrics_next > now)
+		return;
+
+	metrics_next = now + METRICS_INTERVAL;
+
+	metrics_record(p);
+	provider_maintain(p);
+}
+
+/** Returns the epoll_wait() timeout until the next command, linger, respawn or metrics deadline */
+static int get_timeout(void) {
+	int64_t next = -1;
+
+	if (connections)
+		next = connections->deadline;
+
+	if (provider_find(METRICS_COMMAND) && (next < 0 || metrics_next < next))
+		next = metrics_next;
+
+	for (provider_t *p = providers; p; p = p->next) {
+		if (p->linger_until && (next < 0 || p->linger_until < next))
+			next = p->linger_until;
+	}
+
+	for (size_t i = 0; i < n_prespawn; i++) {
+		if (provider_find(prespawn_commands[i]))
+			continue;
+
+		int64_t t = prespawn_times[i] + RESPAWN_DELAY;
+		if (next < 0 || t < next)
+			next = t;
+	}
+
+	if (next < 0)
+		return -1;
+	if (next <= now)
+		return 0;
+	if (next - now > INT32_MAX)
+		return INT32_MAX;
+
+	return next - now;
 }
 
 /**
 	Handles input data from a provider
 
-	clean must be set to true if we are at the end of the header or an SSE
-	record (a double newline).
+	clean must be set to true if we are at the end of the header (a double
+	newline).
 
-	Returns false when the provider has been deleted because all clients
-	disappeared.
+	Returns false when the provider has been deleted.
 */
 static bool provider_data(provider_t *provider, void *buf, size_t len, bool clean) {
 	provider->clean = clean;
@@ -437,62 +1288,204 @@ static void setup_signals(void) {
 	sigaction(SIGPIPE, &action, NULL);
 }
 
-/** Handles input from a provider */
+/**
+	Returns how many bytes may be read from a provider
+
+	Reading is paced by the fastest active client: the provider is not read
+	further ahead than the client queue limit, so the stream isn't consumed
+	faster than any client can receive it. Slower clients lag behind and
+	are handled according to the overflow policy without holding back the
+	others.
+*/
+static size_t provider_read_space(provider_t *p) {
+	uint64_t pos = 0;
+
+	if (p->clients[CLIENT_STATE_ACTIVE]) {
+		/* Active clients that aren't blocked have received everything */
+		pos = p->head;
+	}
+	else if (p->clients[CLIENT_STATE_BLOCKED]) {
+		for (client_t *c = p->clients[CLIENT_STATE_BLOCKED]; c; c = c->next) {
+			if (c->pos > pos)
+				pos = c->pos;
+		}
+	}
+	else {
+		return READ_SIZE;
+	}
+
+	if (p->head - pos >= client_queue_limit)
+		return 0;
+
+	size_t space = client_queue_limit - (p->head - pos);
+	return space < READ_SIZE ? space : READ_SIZE;
+}
+
+static void epoll_handle_provider(provider_t *provider);
+
+/** Continues reading from a paused provider when a client has caught up */
+static void provider_resume(provider_t *p) {
+	if (p->paused && provider_read_space(p)) {
+		p->paused = false;
+		epoll_handle_provider(p);
+	}
+}
+
+/** Handles writability and hangup of a client's socket */
+static void epoll_handle_client(client_t *c, uint32_t events) {
+	provider_t *p = c->provider;
+
+	if (events & (EPOLLERR|EPOLLHUP))
+		client_set_state(c, CLIENT_STATE_CLOSE);
+	else if (events & EPOLLOUT)
+		client_flush(c);
+
+	if (provider_maintain(p))
+		provider_resume(p);
+}
+
+/**
+	Handles input from a provider
+
+	Provider FDs are edge-triggered, so the pipe is read until it is empty.
+*/
 static void epoll_handle_provider(provider_t *provider) {
 	/*
 		The "last" field contains the last character from the previously
 		read buffer. This allows us to search for double newlines that
 		span two reads.
 	*/
-	struct {
+	static struct {
 		char last;
-		char buf[1024];
+		char buf[READ_SIZE];
 	} data;
 
-	data.last = provider->last;
+	while (true) {
+		size_t space = provider_read_space(provider);
+		if (!space) {
+			provider->paused = true;
+			return;
+		}
+
+		data.last = provider->last;
 
-	ssize_t r = read(provider->fd, data.buf, sizeof(data.buf));
-	if (r <= 0) {
-		if (r < 0 && errno == EINTR)
+		ssize_t r = read(provider->fd, data.buf, space);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+		}
+
+		if (r <= 0) {
+			/*
+				EOF before header end: just output the whole block
+				by pretending a clean state
+			*/
+			if (!provider_data(provider, NULL, 0, true))
+				return;
+			provider_eof(provider);
+			provider_maintain(provider);
 			return;
+		}
+
+		provider->last = data.buf[r-1];
+
+		size_t len1 = r;
+		bool clean = false;
 
 		/*
-			EOF before header end: just output the whole block
-			by pretending a clean state and delete the provider
+			While the header is incomplete, split the message at the
+			first separator, so the header ends exactly there and new
+			clients are activated. Separators in the data following the
+			header are handled by provider_handle_data().
 		*/
-		if (!provider_data(provider, NULL, 0, true))
+		if (provider->handler == provider_handle_header) {
+			char *sep = memmem(&data, 1 + r, "\n\n", 2);
+			if (sep) {
+				len1 = (sep + 2) - data.buf;
+				clean = true;
+			}
+		}
+
+		if (!provider_data(provider, data.buf, len1, clean))
 			return;
-		provider_del(provider);
+
+		size_t len2 = r - len1;
+		if (len2 && !provider_data(provider, data.buf + len1, len2, false))
+			return;
+	}
+}
+
+/**
+	Reads the command of a pending connection
+
+	The command is complete when the client has shut down its side of the
+	connection; the socket is then handed over to a new client of the
+	command's provider.
+*/
+static void epoll_handle_connection(connection_t *conn, uint32_t events) {
+	if (events & EPOLLERR) {
+		connection_free(conn, true);
 		return;
 	}
 
-	provider->last = data.buf[r-1];
+	while (true) {
+		char discard[256];
+		bool full = conn->command_len == MAX_COMMAND_LEN;
 
-	char *sep = memmem(&data, 1 + r, "\n\n", 2);
+		ssize_t r;
+		if (full)
+			r = read(conn->fd, discard, sizeof(discard));
+		else
+			r = read(conn->fd, conn->command + conn->command_len, MAX_COMMAND_LEN - conn->command_len);
 
-	/*
-		When we found a separator, split the message, so
-		provider_maintain() is run as soon as possible, in case a new
-		client needs to be activated.
-	*/
-	size_t len1 = sep ? (sep + 2) - data.buf : r;
-	if (!provider_data(provider, data.buf, len1, sep))
-		return;
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				connection_free(conn, true);
+			return;
+		}
 
-	if (!sep)
+		if (r == 0)
+			break;
+
+		if (!full) {
+			conn->command_len += r;
+			continue;
+		}
+
+		/* Data beyond the buffer can only be accepted as part of the Last-Event-ID */
+		if (!memchr(conn->command, 0, conn->command_len)) {
+			syslog(LOG_WARNING, "command too long");
+			connection_free(conn, true);
+			return;
+		}
+
+		conn->id_discarded = true;
+	}
+
+	conn->command[conn->command_len] = 0;
+
+	/* The command may be followed by a null byte and the Last-Event-ID */
+	char *last_event_id = NULL;
+	char *sep = memchr(conn->command, 0, conn->command_len);
+	if (sep && sep[1] && !conn->id_discarded)
+		last_event_id = sep + 1;
+
+	int fd = conn->fd;
+	provider_t *p = provider_get(conn->command);
+	if (p && last_event_id)
+		last_event_id = strdup(last_event_id);
+
+	connection_free(conn, !p);
+	if (!p)
 		return;
 
-	/*
-		If there is a second chunk after the first double newline,
-		we don't need to split it further: All new clients have already
-		been enabled
-	*/
-	size_t len2 = r - len1;
-	if (len2)
-		provider_data(
-			provider, data.buf + len1, len2,
-			data.buf[r-2] == '\n' && data.buf[r-1] == '\n'
-		);
+	client_add(p, fd, last_event_id);
+	if (provider_maintain(p))
+		provider_resume(p);
 }
 
 static void epoll_handle_accept(uint32_t events) {
@@ -501,57 +1494,166 @@ static void epoll_handle_accept(uint32_t events) {
 		exit(1);
 	}
 
-	int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
 	if (fd < 0) {
 		syslog(LOG_WARNING, "accept4: %s\n", strerror(errno));
 		return;
 	}
 
-	char command[1024];
-	char *c = command;
-	while (true) {
-		ssize_t r = read(fd, c, command + (sizeof(command)-1) - c);
-		if (r < 0) {
-			close(fd);
-			return;
-		}
+	connection_t *conn = calloc(1, sizeof(*conn));
+	conn->source = SOURCE_CONNECTION;
+	conn->fd = fd;
+	conn->deadline = now + command_timeout;
 
-		if (r == 0) {
-			*c = 0;
-			break;
-		}
-
-		c += r;
-	}
+	conn->event.events = EPOLLIN;
+	conn->event.data.ptr = conn;
 
-	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
-
-	provider_t *p = provider_get(command);
-	if (!p) {
-		close(fd);
-		return;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &conn->event) < 0) {
+		fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+		exit(1);
 	}
 
-	client_add(p, fd);
-	provider_maintain(p);
+	conn->prev = connections_tail;
+	if (connections_tail)
+		connections_tail->next = conn;
+	else
+		connections = conn;
+	connections_tail = conn;
 }
 
 void cleanup(void) {
+	while (connections)
+		connection_free(connections, true);
+
 	while (providers)
 		provider_del(providers);
 }
 
-int main() {
+static void usage(const char *name) {
+	fprintf(stderr,
+		"Usage: %s [-q <bytes>] [-o <policy>] [-r <records>] [-l <seconds>] [-t <seconds>] [-p <command> ..]\n"
+		"  -q <bytes>   maximum number of bytes queued per client (default: %u, at most %u)\n"
+		"  -o <policy>  handling of clients exceeding the queue limit:\n"
+		"               oldest      drop the oldest records (default)\n"
+		"               latest      skip to the latest complete record\n"
+		"               disconnect  disconnect the client\n"
+		"  -r <records> number of complete records replayed to new clients (default: 0, at most %u)\n"
+		"  -l <seconds> time providers keep running after their last client has disconnected\n"
+		"  -t <seconds> time clients may take to send their command (default: 5)\n"
+		"  -p <command> command started in advance and kept running without clients\n"
+		"The command `%s' streams statistics of the multiplexer itself.\n",
+		name, RING_SIZE/4, RING_SIZE, MAX_RECORDS-1, METRICS_COMMAND
+	);
+}
+
+static void parse_args(int argc, char *argv[]) {
+	int c;
+	while ((c = getopt(argc, argv, "q:o:r:l:t:p:h")) != -1) {
+		switch (c) {
+		case 'q': {
+			char *endptr;
+			unsigned long limit = strtoul(optarg, &endptr, 10);
+			if (!*optarg || *endptr || !limit || limit > RING_SIZE) {
+				fprintf(stderr, "Invalid queue limit `%s'\n", optarg);
+				exit(1);
+			}
+
+			client_queue_limit = limit;
+			break;
+		}
+
+		case 'o':
+			if (!strcmp(optarg, "oldest")) {
+				overflow_policy = OVERFLOW_DROP_OLDEST;
+			}
+			else if (!strcmp(optarg, "latest")) {
+				overflow_policy = OVERFLOW_SKIP_TO_LATEST;
+			}
+			else if (!strcmp(optarg, "disconnect")) {
+				overflow_policy = OVERFLOW_DISCONNECT;
+			}
+			else {
+				fprintf(stderr, "Invalid overflow policy `%s'\n", optarg);
+				exit(1);
+			}
+			break;
+
+		case 'r': {
+			char *endptr;
+			unsigned long records = strtoul(optarg, &endptr, 10);
+			if (!*optarg || *endptr || records >= MAX_RECORDS) {
+				fprintf(stderr, "Invalid number of replayed records `%s'\n", optarg);
+				exit(1);
+			}
+
+			replay_records = records;
+			break;
+		}
+
+		case 'l': {
+			char *endptr;
+			unsigned long linger = strtoul(optarg, &endptr, 10);
+			if (!*optarg || *endptr || linger > INT32_MAX/1000) {
+				fprintf(stderr, "Invalid linger time `%s'\n", optarg);
+				exit(1);
+			}
+
+			linger_time = (int64_t)linger * 1000;
+			break;
+		}
+
+		case 't': {
+			char *endptr;
+			unsigned long timeout = strtoul(optarg, &endptr, 10);
+			if (!*optarg || *endptr || !timeout || timeout > INT32_MAX/1000) {
+				fprintf(stderr, "Invalid command timeout `%s'\n", optarg);
+				exit(1);
+			}
+
+			command_timeout = (int64_t)timeout * 1000;
+			break;
+		}
+
+		case 'p':
+			n_prespawn++;
+			prespawn_commands = realloc(prespawn_commands, n_prespawn * sizeof(*prespawn_commands));
+			prespawn_times = realloc(prespawn_times, n_prespawn * sizeof(*prespawn_times));
+			prespawn_commands[n_prespawn-1] = optarg;
+			prespawn_times[n_prespawn-1] = 0;
+			break;
+
+		case 'h':
+			usage(argv[0]);
+			exit(0);
+
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	parse_args(argc, argv);
+
 	init_epoll();
 	create_socket();
 	setup_signals();
 
 	while (running) {
-		struct epoll_event event;
-		int ret = epoll_wait(epoll_fd, &event, 1, -1);
+		update_time();
+		connections_expire();
+		providers_expire();
+		prespawn();
+		metrics_update();
+
+		int ret = epoll_wait(epoll_fd, events, MAX_EVENTS, get_timeout());
 		if (ret == 0)
 			continue;
 
+		/* Deadlines set while handling the events are relative to the current time */
+		update_time();
+
 		if (ret < 0) {
 			if (errno == EINTR)
 				continue;
@@ -560,10 +1662,36 @@ int main() {
 			exit(1);
 		}
 
-		if (event.data.ptr == &listen_event)
-			epoll_handle_accept(event.events);
-		else
-			epoll_handle_provider(event.data.ptr);
+		n_events = ret;
+
+		for (int i = 0; i < n_events; i++) {
+			void *ptr = events[i].data.ptr;
+
+			/* Object has been freed while handling a previous event */
+			if (!ptr)
+				continue;
+
+			if (ptr == &listen_event) {
+				epoll_handle_accept(events[i].events);
+				continue;
+			}
+
+			switch (*(source_t *)ptr) {
+			case SOURCE_PROVIDER:
+				epoll_handle_provider(ptr);
+				break;
+
+			case SOURCE_CLIENT:
+				epoll_handle_client(ptr, events[i].events);
+				break;
+
+			case SOURCE_CONNECTION:
+				epoll_handle_connection(ptr, events[i].events);
+				break;
+			}
+		}
+
+		n_events = 0;
 	}
 
 	cleanup();